@@ -36,20 +36,86 @@
 
 #pragma once
 
+// clock_gettime(2) and the futex syscall(2) are hidden in strict C11 mode.
+#if !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stddef.h>
+#include <limits.h>
 #include <string.h>
 #include <time.h>
 #include <threads.h>
+
+// The declarations below can also be included from C++ (see future.hpp), where the
+// atomic members are declared with std::atomic, which has the same layout.
+#ifdef __cplusplus
+#include <atomic>
+#define ftr_atomic(T) std::atomic<T>
+using std::atomic_load_explicit;
+using std::atomic_compare_exchange_weak_explicit;
+using std::memory_order_relaxed;
+using std::memory_order_acquire;
+#else
 #include <stdatomic.h>
+#define ftr_atomic(T) _Atomic(T)
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+#include <sys/event.h>
+#define ftr_has_kqueue_
+#endif
+#endif
+
+/**
+ * Define ftr_use_futex to park waiters directly on the state word (futex on Linux,
+ * WaitOnAddress on Windows, __ulock_wait on macOS) instead of a per-future cnd_t + mtx_t.
+ * This makes ftr_init_/ftr_destroy_ essentially free and shrinks the header.
+ * Futures shared between processes (ftr_pshared_init) always park this way, with the
+ * process-shared variants, so they're only available where those exist.
+ */
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#define ftr_has_pshared_
+#elif defined(__APPLE__)
+#define UL_COMPARE_AND_WAIT 1
+#define UL_COMPARE_AND_WAIT_SHARED 3
+#define ULF_WAKE_ALL 0x00000100
+extern int __ulock_wait(uint32_t operation, void* addr, uint64_t value, uint32_t timeout_us);
+extern int __ulock_wake(uint32_t operation, void* addr, uint64_t wake_value);
+#define ftr_has_pshared_
+#endif
+
+#ifdef ftr_use_futex
+#if defined(_WIN32)
+// WaitOnAddress needs Synchronization.lib
+#elif !defined(ftr_has_pshared_)
+#error "ftr_use_futex is not supported on this platform"
+#endif
+#endif
 
 #ifndef define_error
 #define define_error(e) e
 #endif
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 enum {
     ftr_success,
     define_error(ftr_timedout),
@@ -57,428 +123,5408 @@ enum {
     define_error(ftr_nomem),
     define_error(ftr_destsize),
     define_error(ftr_error),
+    define_error(ftr_cancelled),
+    define_error(ftr_broken),
 };
 
+// States of a future, stored in the low bits of ftr_header::state.
+enum {
+    ftr_pending,
+    ftr_completing,
+    ftr_ready,
+    ftr_consumed,
+    ftr_cancelled_state, // Cancelled before a value was produced
+    ftr_failed_state,    // Completed with an error code instead of a value, see ftr_fail
+};
+
+#define ftr_state_mask    0x0fu
+#define ftr_state_waiters 0x10u // Set when some thread is (about to be) parked on the future
+#define ftr_state_gen_shift 8 // The future's generation is kept in the bits above this, see ftr_reset
+#define ftr_state_gen_mask (UINT32_MAX << ftr_state_gen_shift)
+#define ftr_max_error_code INT_MAX
+
+// Flags fixed at initialization, stored in ftr_header::flags.
+#define ftr_flag_shared 0x1u // Multi-consumer: ftr_get_ doesn't consume the value
+#define ftr_flag_pooled 0x2u // Owned by a struct ftr_pool, ftr_delete_ recycles it
+#define ftr_flag_array  0x4u // Element of ftr_new_array, freed with the whole array
+#define ftr_flag_pshared 0x8u // In memory shared between processes, see ftr_pshared_init
+#define ftr_flag_deferred 0x10u // Produced on demand by the function stored before it, see ftr_deferred
+
+#ifndef ftr_cacheline
+#define ftr_cacheline 64
+#endif
+
+/**
+ * Define ftr_cache_align to start every future's header on its own cache line and move the
+ * value to the next one, so a producer writing the value doesn't invalidate the line a
+ * consumer is spinning on, and neighbouring futures never share a line. ftr_new and pools
+ * then allocate with aligned_alloc, at the cost of up to two lines per future.
+ */
+#ifdef __cplusplus
+#define ftr_alignas_(n) alignas(n)
+#else
+#define ftr_alignas_(n) _Alignas(n)
+#endif
+
+#ifdef ftr_cache_align
+#define ftr_align_ ftr_cacheline
+#else
+#define ftr_align_ _Alignof(max_align_t)
+#endif
+
+struct ftr_continuation;
+
 struct ftr_header {
+#ifndef ftr_use_futex
     cnd_t cvar;
     mtx_t mtx;
-    atomic_bool is_valid;
-    bool is_set;
+#endif
+    ftr_atomic(uint32_t) state;
+    uint32_t flags;
+    ftr_atomic(unsigned) refs;
+    uint32_t spins; // Spin iterations before parking, ftr_spin_inherit for the global setting
+    int error; // Code passed to ftr_fail, valid once the state is ftr_failed_state
+    ftr_atomic(struct ftr_continuation*) continuations; // Intrusive stack, see ftr_then
     size_t value_size;
-    size_t in_offs;
-    size_t out_offs;
+    size_t value_offs;
+#ifdef ftr_enable_stats
+    int64_t completed_ns; // When the value was published, for ftr_stats::latency
+#endif
 };
 
-#define ftr_of(ValueType) struct { struct ftr_header header; ValueType in_value; ValueType out_value; }
+#ifdef ftr_cache_align
+#define ftr_of(ValueType) struct { ftr_alignas_(ftr_cacheline) struct ftr_header header; ftr_alignas_(ftr_cacheline) ValueType value; }
+#else
+#define ftr_of(ValueType) struct { struct ftr_header header; ValueType value; }
+#endif
+
+#define ftr_new(FT) ((FT*)ftr_new_(sizeof(FT), sizeof(((FT*)0)->value), offsetof(FT, value), 0))
+
+#define ftr_init(FT, future) (ftr_init_((struct ftr_header*)(future), sizeof(((FT*)0)->value), offsetof(FT, value), 0))
+
+// Shared futures have the same layout, but can be read any number of times and are reference counted.
+#define ftr_shared_of(ValueType) ftr_of(ValueType)
 
-#define ftr_new(FT) ((FT*)ftr_new_(sizeof(FT), sizeof(((FT*)0)->out_value), offsetof(FT, in_value), offsetof(FT, out_value)))
+#define ftr_shared_new(FT) ((FT*)ftr_new_(sizeof(FT), sizeof(((FT*)0)->value), offsetof(FT, value), ftr_flag_shared))
+
+#define ftr_shared_init(FT, future) (ftr_init_((struct ftr_header*)(future), sizeof(((FT*)0)->value), offsetof(FT, value), ftr_flag_shared))
+
+/**
+ * Initializes a future in memory shared between processes (a MAP_SHARED mapping), which any
+ * process mapping it can then complete, fail, cancel, reset, wait on and get from. Waiters
+ * park on the state word with process-shared futex operations instead of cnd_t/mtx_t, and
+ * the header only holds offsets, so each process can map the region at a different address.
+ * The value must not contain pointers either. Continuations can't run in another process,
+ * so ftr_then and everything built on it fail with ftr_invalid. Tear the future down once
+ * with ftr_destroy. Returns ftr_error on platforms without process-shared waits.
+ */
+#define ftr_pshared_init(FT, future) (ftr_init_((struct ftr_header*)(future), sizeof(((FT*)0)->value), offsetof(FT, value), ftr_flag_pshared))
 
-#define ftr_init(FT, future) (ftr_init_((struct ftr_header*)(future), sizeof(((FT*)0)->out_value)), offsetof(FT, in_value), offsetof(FT, out_value))
+#define ftr_shared_ref(future) ((ftr_ref_((struct ftr_header*)(future))), (future))
 
 #define ftr_wait(future, timeout_ms) (ftr_wait_((struct ftr_header*)(future), (timeout_ms)))
 
-#define ftr_get(future, timeout_ms, dest) (ftr_get_((struct ftr_header*)(future), (timeout_ms), (void*)(dest), sizeof(*(dest)), sizeof((*(dest))=future->out_value)))
+// Inline ready-path get for values of up to 8 bytes, see ftr_get_ready_.
+#define ftr_get(future, timeout_ms, dest) \
+    ((sizeof((future)->value) <= ftr_small_size && sizeof(*(dest)) == sizeof((future)->value)) \
+        ? ftr_get_ready_((struct ftr_header*)(future), (timeout_ms), (void*)(dest), sizeof(*(dest)), sizeof((*(dest))=(future)->value)) \
+        : ftr_get_((struct ftr_header*)(future), (timeout_ms), (void*)(dest), sizeof(*(dest)), sizeof((*(dest))=(future)->value)))
+
+#define ftr_peek(future, timeout_ms, out) (ftr_peek_((struct ftr_header*)(future), (timeout_ms), (const void**)(out), sizeof(*(out)=&(future)->value)))
+
+// The value is written straight into its final slot, after the producer has claimed the future.
+#define ftr_complete(future, val) (ftr_claim_((struct ftr_header*)(future)) ? ftr_claim_error_((struct ftr_header*)(future)) : ((future)->value=(val), ftr_complete_((struct ftr_header*)(future))))
+
+#define ftr_complete_ptr(future, src) (ftr_complete_ptr_((struct ftr_header*)(future), (const void*)(src), sizeof(*(src)), sizeof((future)->value=*(src))))
+
+#define ftr_emplace(future) (ftr_claim_((struct ftr_header*)(future)) ? NULL : &(future)->value)
+
+#define ftr_publish(future) (ftr_complete_((struct ftr_header*)(future)))
+
+// Publishes an error instead of the value, for a future claimed with ftr_emplace.
+#define ftr_publish_error(future, code) (ftr_fail_claimed_((struct ftr_header*)(future), (code)))
+
+/**
+ * Completes futures[i] with values[i] for i < n. All of them are published before any
+ * waiter is woken, and only futures that have waiters parked on them get a wakeup.
+ */
+#define ftr_complete_batch(futures, values, n) (ftr_complete_batch_((struct ftr_header**)(futures), (const void*)(values), sizeof(*(values)), (n), sizeof((*(futures))->value=*(values))))
+
+/**
+ * Cancelling a pending future completes it without a value: waiters and consumers get
+ * ftr_cancelled, and so does the producer when it tries to complete it. Producers can
+ * poll ftr_is_cancelled to stop early, or register a callback with ftr_on_cancel.
+ */
+#define ftr_cancel(future) (ftr_cancel_((struct ftr_header*)(future)))
+
+#define ftr_is_cancelled(future) ((atomic_load_explicit(&((struct ftr_header*)(future))->state, memory_order_relaxed) & ftr_state_mask) == ftr_cancelled_state)
+
+#define ftr_on_cancel(future, fn, userdata) (ftr_on_cancel_((struct ftr_header*)(future), (fn), (userdata)))
 
-#define ftr_complete(future, val) ((future)->in_value=(val), ftr_complete_((struct ftr_header*)(future)))
+// Completes the future with an error code, returned by ftr_get/ftr_wait instead of a value.
+#define ftr_fail(future, code) (ftr_fail_((struct ftr_header*)(future), (code)))
 
 #define ftr_destroy(future) (ftr_destroy_((struct ftr_header*)(future)))
 
 #define ftr_delete(future) (ftr_delete_((struct ftr_header*)(future)))
 
-int ftr_init_(struct ftr_header* fh, size_t vsize, size_t in_offs, size_t out_offs);
+/**
+ * Resetting a future that is done (consumed, cancelled, failed or not read yet) makes it
+ * pending again, so a loop can reuse one future per request. Each reset bumps the future's
+ * generation; a producer that was handed the generation with the request completes with
+ * ftr_complete_gen, which fails with ftr_invalid instead of completing a later request.
+ */
+#define ftr_generation(future) (ftr_generation_((struct ftr_header*)(future)))
+
+#define ftr_reset(future) (ftr_reset_((struct ftr_header*)(future)))
+
+#define ftr_complete_gen(future, gen, val) (ftr_claim_gen_((struct ftr_header*)(future), (gen)) ? ftr_claim_gen_error_((struct ftr_header*)(future), (gen)) : ((future)->value=(val), ftr_complete_((struct ftr_header*)(future))))
+
+int ftr_init_(struct ftr_header* fh, size_t vsize, size_t value_offs, uint32_t flags);
+
+struct ftr_header* ftr_new_(size_t wholesize, size_t vsize, size_t value_offs, uint32_t flags);
 
-struct ftr_header* ftr_new_(size_t wholesize, size_t vsize, size_t in_offs, size_t out_offs);
+void ftr_ref_(struct ftr_header* fh);
 
 void ftr_destroy_(struct ftr_header* fh);
 
 void ftr_delete_(struct ftr_header* fh);
 
+uint32_t ftr_generation_(struct ftr_header* fh);
+
+int ftr_reset_(struct ftr_header* fh);
+
+int ftr_claim_gen_(struct ftr_header* fh, uint32_t gen);
+
+int ftr_claim_gen_error_(struct ftr_header* fh, uint32_t gen);
+
 int ftr_wait_(struct ftr_header* fh, int32_t timeout_ms);
 
-int ftr_get_(struct ftr_header* fh, int32_t timeout_ms, void* dest, size_t dest_size, size_t check);
+/**
+ * Deadlines are absolute times on the monotonic clock read by ftr_now, so they're
+ * immune to wall-clock adjustments. ftr_deadline_in builds one from a relative timeout.
+ */
+#define ftr_wait_until(future, deadline) (ftr_wait_until_((struct ftr_header*)(future), (deadline)))
 
-int ftr_complete_(struct ftr_header* fh);
+#define ftr_wait_us(future, timeout_us) (ftr_wait_us_((struct ftr_header*)(future), (timeout_us)))
 
-const char* ftr_errorstr(int err);
+#define ftr_get_until(future, deadline, dest) (ftr_get_until_((struct ftr_header*)(future), (deadline), (void*)(dest), sizeof(*(dest)), sizeof((*(dest))=(future)->value)))
 
-#ifdef ftr_implementation
+void ftr_now(struct timespec* ts);
 
-int ftr_init_(struct ftr_header* fh, size_t vsize, size_t in_offs, size_t out_offs) {
-    fh->is_valid = true;
-    fh->is_set = false;
-    fh->value_size = vsize;
-    fh->in_offs = in_offs;
-    fh->out_offs = out_offs;
-    if (cnd_init(&fh->cvar)) {
-        return ftr_error;
-    }
-    if (mtx_init(&fh->mtx, mtx_plain)) {
-        return ftr_error;
-    }
-    return ftr_success;
-}
+void ftr_deadline_in(struct timespec* deadline, int64_t timeout_us);
 
-struct ftr_header* ftr_new_(size_t wholesize, size_t vsize, size_t in_offs, size_t out_offs) {
-    struct ftr_header* fh = calloc(1, wholesize);
-    int err = ftr_init_(fh, vsize, in_offs, out_offs);
-    if (err) {
-        fprintf(stderr, "error initializing future: %s", ftr_errorstr(err));
-        return NULL;
-    }
-    return fh;
-}
+int ftr_wait_until_(struct ftr_header* fh, const struct timespec* deadline);
 
-void ftr_destroy_(struct ftr_header* fh) {
-    fh->is_valid = false;
-    cnd_destroy(&fh->cvar);
-    mtx_destroy(&fh->mtx);
-}
+int ftr_wait_us_(struct ftr_header* fh, int64_t timeout_us);
 
-void ftr_delete_(struct ftr_header* fh) {
-    ftr_destroy_(fh);
-    free(fh);
-}
+int ftr_get_until_(struct ftr_header* fh, const struct timespec* deadline, void* dest, size_t dest_size, size_t check);
 
-int ftr_wait_(struct ftr_header* fh, int32_t timeout_ms) {
-    mtx_lock(&fh->mtx);
-    if (fh->is_set) {
-        mtx_unlock(&fh->mtx);
-        return ftr_success;
-    }
-    if (timeout_ms == 0) {
-        mtx_unlock(&fh->mtx);
-        return ftr_timedout;
-    }
+/**
+ * Waiting on a pending future first spins (with a CPU pause hint), then yields
+ * the thread a few times, and only then parks. The defaults can be overridden by
+ * defining ftr_default_spins/ftr_default_yields, at runtime with ftr_set_default_spin,
+ * and the spin count per future with ftr_set_spin.
+ */
+#ifndef ftr_default_spins
+#define ftr_default_spins 100
+#endif
 
-    struct timespec start, end;
-    timespec_get(&start, TIME_UTC);
+#ifndef ftr_default_yields
+#define ftr_default_yields 4
+#endif
 
-    end.tv_sec = start.tv_sec + (timeout_ms / 1000);
-    end.tv_nsec = (timeout_ms % 1000) * 1000000;
+#define ftr_spin_inherit UINT32_MAX
 
-    int err = cnd_timedwait(&fh->cvar, &fh->mtx, &end);
-    if (err == thrd_timedout) {
-        mtx_unlock(&fh->mtx);
-        return ftr_timedout;
-    } else if (err) {
-        mtx_unlock(&fh->mtx);
-        return ftr_error;
-    }
+#define ftr_set_spin(future, nspins) (((struct ftr_header*)(future))->spins = (nspins))
 
-    mtx_unlock(&fh->mtx);
-    return ftr_success;
-}
+// How many slow-path waits were resolved by each phase.
+struct ftr_wait_stats {
+    uint64_t spun;
+    uint64_t yielded;
+    uint64_t parked;
+};
 
-int ftr_get_(struct ftr_header* fh, int32_t timeout_ms, void* dest, size_t dest_size, size_t check) {
-    (void)check;
+void ftr_set_default_spin(uint32_t spins, uint32_t yields);
 
-    if (!fh->is_valid) {
-        return ftr_invalid;
-    }
+void ftr_get_wait_stats(struct ftr_wait_stats* stats);
 
-    if (dest_size != fh->value_size) {
-        return ftr_destsize;
-    }
+/**
+ * Define ftr_enable_stats to keep per-thread counters of what futures do, summed over all
+ * threads (including ones that exited) by ftr_stats_snapshot. Each counter is only written
+ * by its own thread, so the hot paths don't share any cache lines. Without it the counters
+ * compile out and ftr_stats_snapshot reports zeros.
+ */
+#ifndef ftr_stats_buckets
+#define ftr_stats_buckets 40
+#endif
 
-    int err = ftr_wait_(fh, timeout_ms);
-    if (err != ftr_success) {
-        return err;
-    }
+struct ftr_stats {
+    uint64_t creates;      // ftr_init/ftr_new/ftr_new_array elements/ftr_pool_acquire
+    uint64_t completions;  // With a value or with ftr_fail
+    uint64_t gets_ready;   // ftr_get calls that found the future done
+    uint64_t gets_blocked; // ftr_get calls that had to wait for it
+    uint64_t timeouts;     // ftr_get calls that timed out
+    uint64_t latency[ftr_stats_buckets]; // Completion to ftr_get, latency[i] counts [2^i, 2^(i+1)) ns
+};
 
-    void* src = (void*)((uint8_t*)(fh) + fh->out_offs); // Out value
-    memcpy(dest, src, fh->value_size);
+void ftr_stats_snapshot(struct ftr_stats* stats);
 
-    fh->is_valid = false;
-    return ftr_success;
-}
+/**
+ * Trace hooks are called on every future's lifecycle events with a timestamp from
+ * ftr_now, in nanoseconds. `result` is the future's outcome for on_complete (0, ftr_cancelled
+ * or the ftr_fail code) and the waiting call's result for on_wait_end. Waits are only traced
+ * when they don't find the future done right away. Null members are skipped. While no hooks
+ * are installed each event costs a single branch.
+ *
+ * Define ftr_enable_usdt to also get USDT probes (provider "future": create, complete,
+ * wait_begin, wait_end, destroy, with the future and result as arguments) for perf,
+ * bpftrace or SystemTap. Needs <sys/sdt.h>.
+ */
+struct ftr_trace_hooks {
+    void (*on_create)(void* userdata, struct ftr_header* fh, int64_t ts_ns);
+    void (*on_complete)(void* userdata, struct ftr_header* fh, int result, int64_t ts_ns);
+    void (*on_wait_begin)(void* userdata, struct ftr_header* fh, int64_t ts_ns);
+    void (*on_wait_end)(void* userdata, struct ftr_header* fh, int result, int64_t ts_ns);
+    void (*on_destroy)(void* userdata, struct ftr_header* fh, int64_t ts_ns);
+    void* userdata;
+};
 
-int ftr_complete_(struct ftr_header* fh) {
-    if ((!fh->is_valid) || fh->is_set) { return ftr_invalid; }
-    
-    mtx_lock(&fh->mtx);
-    
-    void* src = (void*)((uint8_t*)(fh) + fh->in_offs); // In value
-    void* dest = (void*)((uint8_t*)(fh) + fh->out_offs); // Out value
-    memcpy(dest, src, fh->value_size);
-    fh->is_set = true;
+// Installs `hooks`, which must stay valid until replaced. NULL removes them.
+void ftr_set_trace_hooks(const struct ftr_trace_hooks* hooks);
 
-    cnd_signal(&fh->cvar);
-    mtx_unlock(&fh->mtx);
+int ftr_get_(struct ftr_header* fh, int32_t timeout_ms, void* dest, size_t dest_size, size_t check);
 
-    return ftr_success;
-}
+#define ftr_small_size 8
 
-const char* ftr_errorstr(int err) {
-    switch (err) {
-    case ftr_success:   return "ftr_success";
-    case ftr_invalid:   return "ftr_invalid: Invalid future object";
-    case ftr_timedout:  return "ftr_timedout: Operation timed out";
-    case ftr_nomem:     return "ftr_nomem: No memory available";
-    case ftr_destsize:  return "ftr_destsize: The destination size is different from the value size";
-    default:            return "ftr_errorstr: Unknown error";
+/**
+ * Inline ready-path get: a load, a CAS on the state and a fixed-size copy of the value.
+ * Anything else (pending, consumed, stats enabled) goes through ftr_get_. The future's
+ * layout and ftr_complete are the same as for any other value.
+ */
+static inline int ftr_get_ready_(struct ftr_header* fh, int32_t timeout_ms, void* dest, size_t size, size_t check) {
+#ifndef ftr_enable_stats
+    const void* value = (const uint8_t*)fh + fh->value_offs;
+    uint32_t s = atomic_load_explicit(&fh->state, memory_order_acquire);
+    if ((s & ftr_state_mask) == ftr_ready) {
+        if (fh->flags & ftr_flag_shared) {
+            memcpy(dest, value, size);
+            return ftr_success;
+        }
+        // Same transition as ftr_take_: keeps the generation, drops the waiters bit.
+        if (atomic_compare_exchange_weak_explicit(&fh->state, &s, (s & ftr_state_gen_mask) | ftr_consumed,
+                                                  memory_order_acquire, memory_order_relaxed)) {
+            memcpy(dest, value, size);
+            return ftr_success;
+        }
     }
+#endif
+    return ftr_get_(fh, timeout_ms, dest, size, check);
 }
 
-#endif
+int ftr_peek_(struct ftr_header* fh, int32_t timeout_ms, const void** out, size_t check);
 
-#ifdef ftr_unittest
+int ftr_claim_(struct ftr_header* fh);
 
-#include <assert.h>
+int ftr_claim_error_(struct ftr_header* fh);
 
-typedef ftr_of(int) int_future_t;
+int ftr_cancel_(struct ftr_header* fh);
 
-int run_async_task(void* arg) {
-    int_future_t* fut = arg;
-    thrd_sleep(&(struct timespec){.tv_sec=2}, NULL);
-    int err = ftr_complete(fut, 42);
-    if (err) {
-        fprintf(stderr, "error completing future: %s\n", ftr_errorstr(err));
-        return 1;
-    }
-    return 0;
-}
+int ftr_fail_(struct ftr_header* fh, int code);
 
-int run_async_task_veryslow(void* arg) {
-    int_future_t* fut = arg;
-    thrd_sleep(&(struct timespec){.tv_sec=5}, NULL);
-    int err = ftr_complete(fut, 42);
-    if (err) {
-        fprintf(stderr, "error completing future: %s\n", ftr_errorstr(err));
-        return 1;
-    }
-    return 0;
-}
+int ftr_fail_claimed_(struct ftr_header* fh, int code);
 
-typedef ftr_of(int16_t) int16_future_t;
+/**
+ * Promise/future handles split the producer and consumer side of one heap future.
+ * Each handle owns a reference and is consumed by the call that completes or
+ * releases it (which also clears it), so the state is freed by whichever side
+ * finishes last with no extra synchronization. Releasing an unfulfilled promise
+ * fails the future with ftr_broken; releasing a future nobody completed yet
+ * cancels it, so the producer can notice with ftr_promise_is_cancelled.
+ */
+#define ftr_promise_of(FT) struct { FT* state; }
 
-bool ftr_test_valuesize() {
-    printf("ftr_test_valuesize\n");
+#define ftr_future_of(FT) struct { FT* state; }
 
-    int16_future_t* fut = ftr_new(int16_future_t);
-    printf("fut->header.value_size = %d, sizeof = %d\n", fut->header.value_size, sizeof(int16_t));
-    assert(fut->header.value_size == sizeof(int16_t));
-    ftr_delete(fut);
-    return true;
-}
+#define ftr_promise_new(FT, promise, future) (((promise)->state = (future)->state = ftr_new(FT)) ? (ftr_ref_(&(promise)->state->header), ftr_success) : ftr_nomem)
 
-bool ftr_test_samethread() {
-    printf("ftr_test_samethread\n");
-    
-    int_future_t* fut = ftr_new(int_future_t);
-    assert(fut);
-    assert(fut->in_value == 0 || !"value is zero initialized");
-    assert(fut->out_value == 0 || !"value is zero initialized");
-    assert(fut->header.is_valid || !"is valid");
+#define ftr_promise_complete(promise, val) (ftr_promise_settle_((promise), ftr_complete((promise)->state, (val))))
 
-    ftr_complete(fut, 42);
+#define ftr_promise_fail(promise, code) (ftr_promise_settle_((promise), ftr_fail((promise)->state, (code))))
 
-    int result;
-    int err = ftr_get(fut, 10*1000, &result); if (err) {
-        fprintf(stderr, "error getting future: %s\n", ftr_errorstr(err));
-        ftr_delete(fut);
-        return false;
-    }
+#define ftr_promise_is_cancelled(promise) (ftr_is_cancelled((promise)->state))
 
-    assert(result == 42);
+#define ftr_promise_release(promise) (ftr_promise_release_((promise)))
 
-    return true;
-}
+#define ftr_future_wait(future, timeout_ms) (ftr_wait((future)->state, (timeout_ms)))
 
-bool ftr_test_twice() {
-    printf("ftr_test_twice\n");
+#define ftr_future_get(future, timeout_ms, dest) (ftr_get((future)->state, (timeout_ms), (dest)))
 
-    int_future_t* fut = ftr_new(int_future_t);
-    ftr_complete(fut, 42);
+#define ftr_future_release(future) (ftr_future_release_((future)))
 
-    int result;
-    int err = ftr_get(fut, 10*1000, &result); if (err) {
-        fprintf(stderr, "error getting future: %s\n", ftr_errorstr(err));
-        ftr_delete(fut);
-        return false;
-    }
+int ftr_promise_settle_(void* promise, int err);
 
-    err = ftr_complete(fut, 100);
-    assert(err == ftr_invalid);
+void ftr_promise_release_(void* promise);
 
-    err = ftr_get(fut, 10*1000, &result);
-    assert(err == ftr_invalid);
+void ftr_future_release_(void* future);
 
-    ftr_delete(fut);
-    return true;
-}
+int ftr_complete_(struct ftr_header* fh);
 
-bool ftr_test_success() {
-    printf("ftr_test_success\n");
+int ftr_complete_ptr_(struct ftr_header* fh, const void* src, size_t src_size, size_t check);
 
-    int_future_t* fut = ftr_new(int_future_t);
+int ftr_complete_batch_(struct ftr_header** futures, const void* values, size_t value_size, size_t n, size_t check);
 
-    thrd_t thread = {0};
+/**
+ * Future arrays lay out n futures in one allocation, each starting on its own cache line
+ * so adjacent futures' state words don't false-share. Index them with ftr_array_at.
+ */
+#define ftr_array_stride(size) (((size) + ftr_cacheline - 1) / ftr_cacheline * ftr_cacheline)
 
-    thrd_create(&thread, run_async_task, fut);
-   
-    int result;
-    int err = ftr_get(fut, 4 * 1000, &result);
-    assert(err == ftr_success);
-    if (err) {
-        fprintf(stderr, "error waiting future: %s\n", ftr_errorstr(err));
-        thrd_join(thread, NULL);
-        ftr_delete(fut);
-        return false;
-    }
- 
-    assert(result == 42);
+#define ftr_new_array(FT, n) ((FT*)ftr_new_array_(sizeof(FT), sizeof(((FT*)0)->value), offsetof(FT, value), (n)))
 
-    thrd_join(thread, NULL);
-    ftr_delete(fut);
-    return true;
-}
+#define ftr_array_at(futures, i) ((void*)((uint8_t*)(futures) + (size_t)(i) * ftr_array_stride(sizeof(*(futures)))))
 
-bool ftr_test_timedout() {
-    printf("ftr_test_timedout\n");
+#define ftr_delete_array(futures, n) (ftr_delete_array_((struct ftr_header*)(futures), ftr_array_stride(sizeof(*(futures))), (n)))
 
-    int_future_t* fut = ftr_new(int_future_t);
+struct ftr_header* ftr_new_array_(size_t wholesize, size_t vsize, size_t value_offs, size_t n);
 
-    thrd_t thread = {0};
+void ftr_delete_array_(struct ftr_header* first, size_t stride, size_t n);
 
-    thrd_create(&thread, run_async_task_veryslow, fut);
-   
-    int result;
-    int err = ftr_get(fut, 4 * 1000, &result);
-    assert(err == ftr_timedout);
-    if (err) {
-        fprintf(stderr, "error waiting future: %s\n", ftr_errorstr(err));
-        thrd_join(thread, NULL);
-        ftr_delete(fut);
-        return true;
+/**
+ * Future pools recycle futures of one type, keeping their synchronization state
+ * initialized. Slots are carved out of slabs of `capacity` futures and cached per
+ * thread, so acquire/release in steady state does no malloc/free or cnd/mtx init.
+ */
+struct ftr_pool_slot;
+struct ftr_pool_slab;
+
+struct ftr_pool {
+    mtx_t mtx;
+    uint64_t id; // Unique per pool, lets thread caches detect a destroyed pool
+    size_t wholesize;
+    size_t value_size;
+    size_t value_offs;
+    size_t stride;
+    size_t capacity;
+    struct ftr_pool_slab* slabs;
+    struct ftr_pool_slot* free_list;
+    int node; // NUMA node the slabs are placed on, -1 for wherever they're first touched
+};
+
+#define ftr_pool_create(FT, capacity) (ftr_pool_create_(sizeof(FT), sizeof(((FT*)0)->value), offsetof(FT, value), (capacity), -1))
+
+// Like ftr_pool_create, with the slabs preferably placed on NUMA node `node`.
+#define ftr_pool_create_on(FT, capacity, node) (ftr_pool_create_(sizeof(FT), sizeof(((FT*)0)->value), offsetof(FT, value), (capacity), (node)))
+
+#define ftr_pool_acquire(pool) ((void*)ftr_pool_acquire_(pool))
+
+#define ftr_pool_release(pool, future) (ftr_pool_release_((pool), (struct ftr_header*)(future)))
+
+struct ftr_pool* ftr_pool_create_(size_t wholesize, size_t vsize, size_t value_offs, size_t capacity, int node);
+
+void ftr_pool_destroy(struct ftr_pool* pool);
+
+struct ftr_header* ftr_pool_acquire_(struct ftr_pool* pool);
+
+void ftr_pool_release_(struct ftr_pool* pool, struct ftr_header* fh);
+
+/**
+ * Executors run tasks on a fixed set of worker threads. Each worker owns a deque:
+ * tasks submitted from a worker go to its own deque, others are spread round-robin,
+ * and idle workers steal from the other end of their peers' deques.
+ */
+typedef void (*ftr_task_fn)(void* arg, void* value);
+
+struct ftr_task {
+    ftr_task_fn fn;
+    void* arg;
+    struct ftr_header* future; // Completed with the task's result, or NULL
+};
+
+struct ftr_executor;
+
+/**
+ * NUMA nodes are discovered from sysfs on Linux, without libnuma. Elsewhere there is a
+ * single node 0 and pinning is a no-op. CPU masks cover the first ftr_numa_max_cpus CPUs.
+ */
+#ifndef ftr_numa_max_cpus
+#define ftr_numa_max_cpus 1024
+#endif
+
+// Number of NUMA nodes, at least 1.
+int ftr_numa_nodes(void);
+
+// NUMA node of the CPU the calling thread is running on.
+int ftr_numa_node(void);
+
+struct ftr_deferred_;
+
+struct ftr_worker {
+    mtx_t mtx;
+    struct ftr_task* tasks; // Ring buffer, owner pops from the back, thieves from the front
+    size_t capacity;
+    size_t head;
+    size_t count;
+    thrd_t thread;
+    struct ftr_executor* exec;
+    size_t index;
+};
+
+struct ftr_executor {
+    struct ftr_worker* workers;
+    size_t nworkers;
+    mtx_t mtx;
+    cnd_t cvar; // Idle workers park here
+    ftr_atomic(size_t) pending;
+    ftr_atomic(size_t) nidle;
+    ftr_atomic(size_t) next;
+    ftr_atomic(bool) stopping;
+    struct ftr_deferred_* deferred_head; // Queued by ftr_deferred_on for idle workers, under mtx
+    struct ftr_deferred_* deferred_tail;
+    int node; // NUMA node the workers are pinned to, -1 if they aren't
+    unsigned long cpus[ftr_numa_max_cpus / (8 * sizeof(unsigned long))];
+};
+
+// Runs `fn(arg, &future->value)` on the executor and completes the returned future with it.
+#define ftr_async(exec, FT, fn, arg) ((FT*)ftr_async_((exec), sizeof(FT), sizeof(((FT*)0)->value), offsetof(FT, value), (fn), (arg)))
+
+/**
+ * Deferred futures keep `fn(arg, &future->value)` and only run it on demand, on the thread
+ * of the first ftr_get/ftr_peek/ftr_wait of any kind (a poll with a 0 timeout, ftr_wait_all
+ * and ftr_wait_any included), so there's no handoff and a future nobody reads costs nothing.
+ * With ftr_deferred_on an idle worker of exec may also run it early, once nothing else is
+ * queued. Continuations, combinators and notifiers alone don't start it.
+ */
+#define ftr_deferred(FT, fn, arg) ((FT*)ftr_deferred_(NULL, sizeof(FT), sizeof(((FT*)0)->value), offsetof(FT, value), (fn), (arg)))
+
+#define ftr_deferred_on(exec, FT, fn, arg) ((FT*)ftr_deferred_((exec), sizeof(FT), sizeof(((FT*)0)->value), offsetof(FT, value), (fn), (arg)))
+
+struct ftr_executor* ftr_executor_create(size_t nthreads);
+
+/**
+ * Starts an executor whose workers are pinned to the CPUs of NUMA node `node`, one per CPU
+ * if nthreads is 0. Memory first touched by its tasks (ftr_async values, pools grown on a
+ * worker) is then node-local too. With node -1 this is ftr_executor_create.
+ */
+struct ftr_executor* ftr_executor_create_on(size_t nthreads, int node);
+
+void ftr_executor_destroy(struct ftr_executor* exec);
+
+int ftr_executor_submit(struct ftr_executor* exec, ftr_task_fn fn, void* arg);
+
+struct ftr_header* ftr_async_(struct ftr_executor* exec, size_t wholesize, size_t vsize, size_t value_offs, ftr_task_fn fn, void* arg);
+
+struct ftr_header* ftr_deferred_(struct ftr_executor* exec, size_t wholesize, size_t vsize, size_t value_offs, ftr_task_fn fn, void* arg);
+
+/**
+ * Continuations are callbacks run once a future completes, either inline by the thread
+ * calling ftr_complete_ or on an executor. They're kept in a lock-free stack in the
+ * header; registering on an already completed future runs the callback right away.
+ * The future is kept alive (referenced) until the callback has run.
+ */
+typedef void (*ftr_then_fn)(void* userdata, void* future);
+
+struct ftr_continuation {
+    struct ftr_continuation* next;
+    ftr_then_fn fn;
+    void* userdata;
+    struct ftr_executor* exec; // Where to run fn, NULL to run it inline
+    struct ftr_header* future;
+    bool owned; // Allocated by ftr_then_, freed once it ran
+    bool cancel_only; // Registered with ftr_on_cancel, fn is skipped unless the future was cancelled
+};
+
+#define ftr_then(future, fn, userdata) (ftr_then_((struct ftr_header*)(future), NULL, (fn), (userdata)))
+
+#define ftr_then_on(exec, future, fn, userdata) (ftr_then_((struct ftr_header*)(future), (exec), (fn), (userdata)))
+
+#define ftr_then_node(future, node) (ftr_then_node_((struct ftr_header*)(future), (node)))
+
+/**
+ * Runs fn on the executor of the registering thread's NUMA node, so a consumer reads the
+ * result where it will use it. `execs` is indexed by node, e.g. from ftr_executor_create_on
+ * for every node below ftr_numa_nodes().
+ */
+#define ftr_then_local(execs, future, fn, userdata) (ftr_then_((struct ftr_header*)(future), (execs)[ftr_numa_node()], (fn), (userdata)))
+
+int ftr_then_(struct ftr_header* fh, struct ftr_executor* exec, ftr_then_fn fn, void* userdata);
+
+int ftr_then_node_(struct ftr_header* fh, struct ftr_continuation* node);
+
+int ftr_on_cancel_(struct ftr_header* fh, ftr_then_fn fn, void* userdata);
+
+/**
+ * Fails the future with ftr_timedout if it's still pending after timeout_ms, so code that
+ * reacts to completion (ftr_then, ftr_notify, co_await) gets timeouts without a blocked
+ * thread or a kernel timer per future. All timeouts share one hierarchical timer wheel
+ * with 1 ms ticks, driven by a thread started on first use: arming and disarming are O(1)
+ * and expirations are batched per tick. The timeout is disarmed when the future completes
+ * some other way. A producer that already claimed the future keeps it.
+ * Continuations of a future that timed out run on the wheel thread, unless they were given
+ * an executor. The wheel thread holds a reference while failing a future, but futures that
+ * aren't reference counted (ftr_init, arrays, pools) have to outlive their timeout, as they
+ * would any other producer.
+ */
+#define ftr_timeout(future, timeout_ms) (ftr_timeout_((struct ftr_header*)(future), (timeout_ms)))
+
+int ftr_timeout_(struct ftr_header* fh, int32_t timeout_ms);
+
+/**
+ * Combinators over arrays of future pointers. They register one continuation per input
+ * on a single waiter future, so the caller parks once and is woken exactly when all
+ * (or the first) of the inputs completed. The when_ variants return that future: its value
+ * is the number of inputs for ftr_when_all and the index of the first one for ftr_when_any.
+ */
+typedef ftr_of(size_t) ftr_when_future_t;
+
+#define ftr_wait_all(futures, n, timeout_ms) (ftr_wait_all_((struct ftr_header**)(futures), (n), (timeout_ms)))
+
+#define ftr_wait_any(futures, n, timeout_ms, index) (ftr_wait_any_((struct ftr_header**)(futures), (n), (timeout_ms), (index)))
+
+#define ftr_when_all(futures, n) ((ftr_when_future_t*)ftr_when_((struct ftr_header**)(futures), (n), false))
+
+#define ftr_when_any(futures, n) ((ftr_when_future_t*)ftr_when_((struct ftr_header**)(futures), (n), true))
+
+int ftr_wait_all_(struct ftr_header** futures, size_t n, int32_t timeout_ms);
+
+int ftr_wait_any_(struct ftr_header** futures, size_t n, int32_t timeout_ms, size_t* index);
+
+struct ftr_header* ftr_when_(struct ftr_header** futures, size_t n, bool any);
+
+/**
+ * Notifiers let event loops multiplex many futures without a thread per wait. Futures
+ * attached with ftr_notify are queued when they complete, and the notifier's descriptor
+ * (an eventfd on Linux, a kqueue with an EVFILT_USER event on macOS/BSD, a pipe on other
+ * POSIX systems) becomes readable. Wakeups are coalesced: the descriptor is signaled only
+ * when the queue goes from empty to non-empty, and ftr_notifier_drain takes a whole batch.
+ * Not available on Windows.
+ */
+struct ftr_notify_node_;
+
+struct ftr_notifier {
+    int fd;
+    int wfd; // Write end when backed by a pipe, -1 otherwise
+    ftr_atomic(unsigned) refs; // The owner plus every attached future that didn't complete yet
+    ftr_atomic(bool) closed;
+    ftr_atomic(struct ftr_notify_node_*) ready;
+    struct ftr_notify_node_* backlog; // Drained from ready but not returned yet, used by the draining thread only
+};
+
+#define ftr_notify(notifier, future) (ftr_notify_((notifier), (struct ftr_header*)(future)))
+
+#define ftr_notifier_drain(notifier, futures, max) (ftr_notifier_drain_((notifier), (struct ftr_header**)(futures), (max)))
+
+struct ftr_notifier* ftr_notifier_create(void);
+
+void ftr_notifier_destroy(struct ftr_notifier* n);
+
+int ftr_get_fd(struct ftr_notifier* n);
+
+int ftr_notify_(struct ftr_notifier* n, struct ftr_header* fh);
+
+size_t ftr_notifier_drain_(struct ftr_notifier* n, struct ftr_header** futures, size_t max);
+
+/**
+ * Channels are bounded multi-producer multi-consumer queues of values, for streams
+ * between threads without allocating a future per message. The ring buffer is lock-free
+ * (a sequence number per cell), with the send and receive positions on their own cache
+ * lines. Blocked senders and receivers spin, yield and then park on an event in the
+ * channel the same way ftr_wait_ does, and are only woken when someone is parked.
+ */
+struct ftr_channel {
+    uint8_t* cells;
+    size_t mask; // Capacity - 1, the capacity is a power of two
+    size_t value_size;
+    size_t stride; // Size of a cell: its sequence number followed by the value
+    uint8_t pad_meta_[ftr_cacheline - sizeof(uint8_t*) - 3 * sizeof(size_t)];
+    ftr_atomic(size_t) tail; // Next position to send to
+    uint8_t pad_tail_[ftr_cacheline - sizeof(size_t)];
+    ftr_atomic(size_t) head; // Next position to receive from
+    uint8_t pad_head_[ftr_cacheline - sizeof(size_t)];
+    struct ftr_header not_empty; // Receivers park here, the state counts signals
+    struct ftr_header not_full;  // Senders park here
+};
+
+#define ftr_channel_of(ValueType) struct { struct ftr_channel channel; ValueType value[]; }
+
+#define ftr_channel_new(CT, capacity) ((CT*)ftr_channel_new_(sizeof(CT), sizeof(((CT*)0)->value[0]), (capacity)))
+
+#define ftr_channel_delete(chan) (ftr_channel_delete_(&(chan)->channel))
+
+#define ftr_channel_send(chan, timeout_ms, src) (ftr_channel_send_(&(chan)->channel, (timeout_ms), (const void*)(src), sizeof(*(src)), 1, NULL, sizeof((chan)->value[0]=*(src))))
+
+#define ftr_channel_recv(chan, timeout_ms, dest) (ftr_channel_recv_(&(chan)->channel, (timeout_ms), (void*)(dest), sizeof(*(dest)), 1, NULL, sizeof(*(dest)=(chan)->value[0])))
+
+// Send/receive up to n values at once, waiting only until the first one can be transferred.
+#define ftr_channel_send_batch(chan, timeout_ms, src, n, sent) (ftr_channel_send_(&(chan)->channel, (timeout_ms), (const void*)(src), sizeof(*(src)), (n), (sent), sizeof((chan)->value[0]=*(src))))
+
+#define ftr_channel_recv_batch(chan, timeout_ms, dest, n, received) (ftr_channel_recv_(&(chan)->channel, (timeout_ms), (void*)(dest), sizeof(*(dest)), (n), (received), sizeof(*(dest)=(chan)->value[0])))
+
+struct ftr_channel* ftr_channel_new_(size_t wholesize, size_t vsize, size_t capacity);
+
+void ftr_channel_delete_(struct ftr_channel* ch);
+
+int ftr_channel_send_(struct ftr_channel* ch, int32_t timeout_ms, const void* src, size_t src_size, size_t n, size_t* sent, size_t check);
+
+int ftr_channel_recv_(struct ftr_channel* ch, int32_t timeout_ms, void* dest, size_t dest_size, size_t n, size_t* received, size_t check);
+
+/**
+ * Keyed cache of shared futures, to run one fetch per key however many callers ask for it
+ * at once. The first caller for a key gets a new pending future and fn is called (on its
+ * thread, without any lock held) to start producing it; everyone asking while it's pending
+ * or still fresh gets the same future. Completed values are kept for ttl_ms after they were
+ * published, failed or cancelled ones are dropped so the next caller retries. Keys are
+ * spread over nshards independently locked maps with capacity/nshards entries each, the
+ * least recently used completed entry is evicted from a full shard (pending ones never are).
+ */
+typedef void (*ftr_cache_fn)(void* arg, const char* key, void* future);
+
+#define ftr_cache_create(FT, nshards, capacity, ttl_ms) (ftr_cache_create_(sizeof(FT), sizeof(((FT*)0)->value), offsetof(FT, value), (nshards), (capacity), (ttl_ms)))
+
+struct ftr_cache* ftr_cache_create_(size_t wholesize, size_t vsize, size_t value_offs, size_t nshards, size_t capacity, int32_t ttl_ms);
+
+// Releases the cache's references. Futures still held stay valid; pending ones that aren't
+// are only kept alive by the cache's continuation, until they complete, fail or are cancelled.
+void ftr_cache_destroy(struct ftr_cache* cache);
+
+/**
+ * Returns the key's future with a reference for the caller to release with ftr_delete, or
+ * NULL if out of memory. The future is shared, so ftr_get can be called on it any number of
+ * times. fn has to complete, fail or cancel it eventually, key is only valid during the call.
+ */
+void* ftr_cache_get_or_start(struct ftr_cache* cache, const char* key, ftr_cache_fn fn, void* arg);
+
+// Drops the key's entry, so the next caller starts over.
+void ftr_cache_remove(struct ftr_cache* cache, const char* key);
+
+const char* ftr_errorstr(int err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef ftr_implementation
+
+static inline int64_t ftr_now_ns_(void) {
+    struct timespec ts;
+    ftr_now(&ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#if defined(__GNUC__)
+#define ftr_unlikely_(x) __builtin_expect(!!(x), 0)
+#else
+#define ftr_unlikely_(x) (x)
+#endif
+
+#ifdef ftr_enable_usdt
+#include <sys/sdt.h>
+#define ftr_probe_(event, fh, result) DTRACE_PROBE2(future, event, (fh), (result))
+#else
+#define ftr_probe_(event, fh, result) ((void)0)
+#endif
+
+enum {
+    ftr_trace_create_,
+    ftr_trace_complete_,
+    ftr_trace_wait_begin_,
+    ftr_trace_wait_end_,
+    ftr_trace_destroy_,
+};
+
+static atomic_uintptr_t ftr_trace_hooks_;
+
+void ftr_set_trace_hooks(const struct ftr_trace_hooks* hooks) {
+    atomic_store_explicit(&ftr_trace_hooks_, (uintptr_t)hooks, memory_order_release);
+}
+
+static void ftr_trace_call_(int event, struct ftr_header* fh, int result) {
+    const struct ftr_trace_hooks* h = (const struct ftr_trace_hooks*)atomic_load_explicit(&ftr_trace_hooks_, memory_order_acquire);
+    if (!h) {
+        return;
+    }
+    switch (event) {
+    case ftr_trace_create_:     if (h->on_create) { h->on_create(h->userdata, fh, ftr_now_ns_()); } break;
+    case ftr_trace_complete_:   if (h->on_complete) { h->on_complete(h->userdata, fh, result, ftr_now_ns_()); } break;
+    case ftr_trace_wait_begin_: if (h->on_wait_begin) { h->on_wait_begin(h->userdata, fh, ftr_now_ns_()); } break;
+    case ftr_trace_wait_end_:   if (h->on_wait_end) { h->on_wait_end(h->userdata, fh, result, ftr_now_ns_()); } break;
+    case ftr_trace_destroy_:    if (h->on_destroy) { h->on_destroy(h->userdata, fh, ftr_now_ns_()); } break;
+    }
+}
+
+#define ftr_trace_(event, fh, result) do { \
+        ftr_probe_(event, (fh), (result)); \
+        if (ftr_unlikely_(atomic_load_explicit(&ftr_trace_hooks_, memory_order_relaxed))) { \
+            ftr_trace_call_(ftr_trace_##event##_, (fh), (result)); \
+        } \
+    } while (0)
+
+#ifdef ftr_enable_stats
+
+// One per thread, linked into a global list so ftr_stats_snapshot can sum them.
+struct ftr_stats_thread_ {
+    struct ftr_stats_thread_* next;
+    atomic_uint_fast64_t creates;
+    atomic_uint_fast64_t completions;
+    atomic_uint_fast64_t gets_ready;
+    atomic_uint_fast64_t gets_blocked;
+    atomic_uint_fast64_t timeouts;
+    atomic_uint_fast64_t latency[ftr_stats_buckets];
+};
+
+static once_flag ftr_stats_once_ = ONCE_FLAG_INIT;
+static mtx_t ftr_stats_mtx_;
+static tss_t ftr_stats_key_;
+static struct ftr_stats_thread_* ftr_stats_threads_;
+static struct ftr_stats ftr_stats_exited_; // Folded in from threads that exited, under ftr_stats_mtx_
+static struct ftr_stats_thread_ ftr_stats_fallback_; // Shared by threads that couldn't allocate theirs
+static _Thread_local struct ftr_stats_thread_* ftr_stats_self_;
+
+static void ftr_stats_add_(struct ftr_stats* sum, struct ftr_stats_thread_* t) {
+    sum->creates += atomic_load_explicit(&t->creates, memory_order_relaxed);
+    sum->completions += atomic_load_explicit(&t->completions, memory_order_relaxed);
+    sum->gets_ready += atomic_load_explicit(&t->gets_ready, memory_order_relaxed);
+    sum->gets_blocked += atomic_load_explicit(&t->gets_blocked, memory_order_relaxed);
+    sum->timeouts += atomic_load_explicit(&t->timeouts, memory_order_relaxed);
+    for (size_t i = 0; i < ftr_stats_buckets; i++) {
+        sum->latency[i] += atomic_load_explicit(&t->latency[i], memory_order_relaxed);
+    }
+}
+
+static void ftr_stats_thread_exit_(void* arg) {
+    struct ftr_stats_thread_* t = arg;
+    mtx_lock(&ftr_stats_mtx_);
+    struct ftr_stats_thread_** link = &ftr_stats_threads_;
+    while (*link != t) {
+        link = &(*link)->next;
+    }
+    *link = t->next;
+    ftr_stats_add_(&ftr_stats_exited_, t);
+    mtx_unlock(&ftr_stats_mtx_);
+    free(t);
+}
+
+static void ftr_stats_init_(void) {
+    mtx_init(&ftr_stats_mtx_, mtx_plain);
+    tss_create(&ftr_stats_key_, ftr_stats_thread_exit_);
+}
+
+static struct ftr_stats_thread_* ftr_stats_register_(void) {
+    call_once(&ftr_stats_once_, ftr_stats_init_);
+    struct ftr_stats_thread_* t = calloc(1, sizeof(struct ftr_stats_thread_));
+    if (!t) {
+        return &ftr_stats_fallback_;
+    }
+    mtx_lock(&ftr_stats_mtx_);
+    t->next = ftr_stats_threads_;
+    ftr_stats_threads_ = t;
+    mtx_unlock(&ftr_stats_mtx_);
+    tss_set(ftr_stats_key_, t);
+    ftr_stats_self_ = t;
+    return t;
+}
+
+static inline struct ftr_stats_thread_* ftr_stats_local_(void) {
+    return ftr_stats_self_ ? ftr_stats_self_ : ftr_stats_register_();
+}
+
+// Only the owning thread writes its counters, a plain load + store is enough.
+static inline void ftr_stats_bump_(atomic_uint_fast64_t* counter) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+static inline void ftr_stats_latency_(struct ftr_header* fh) {
+    uint64_t ns = (uint64_t)(ftr_now_ns_() - fh->completed_ns);
+    size_t bucket = 0;
+#if defined(__GNUC__)
+    bucket = ns > 1 ? (size_t)(63 - __builtin_clzll(ns)) : 0;
+#else
+    while (ns >>= 1) { bucket++; }
+#endif
+    if (bucket >= ftr_stats_buckets) {
+        bucket = ftr_stats_buckets - 1;
+    }
+    ftr_stats_bump_(&ftr_stats_local_()->latency[bucket]);
+}
+
+#define ftr_stat_(counter) (ftr_stats_bump_(&ftr_stats_local_()->counter))
+#define ftr_stat_completed_(fh) ((fh)->completed_ns = ftr_now_ns_(), ftr_stat_(completions))
+#define ftr_stat_consumed_(fh) (ftr_stats_latency_(fh))
+#define ftr_stat_get_(fh) (((atomic_load_explicit(&(fh)->state, memory_order_relaxed) & ftr_state_mask) >= ftr_ready) ? ftr_stat_(gets_ready) : ftr_stat_(gets_blocked))
+
+#else
+
+#define ftr_stat_(counter) ((void)0)
+#define ftr_stat_completed_(fh) ((void)0)
+#define ftr_stat_consumed_(fh) ((void)0)
+#define ftr_stat_get_(fh) ((void)0)
+
+#endif
+
+void ftr_stats_snapshot(struct ftr_stats* stats) {
+    memset(stats, 0, sizeof(*stats));
+#ifdef ftr_enable_stats
+    call_once(&ftr_stats_once_, ftr_stats_init_);
+    ftr_stats_add_(stats, &ftr_stats_fallback_);
+    mtx_lock(&ftr_stats_mtx_);
+    for (struct ftr_stats_thread_* t = ftr_stats_threads_; t; t = t->next) {
+        ftr_stats_add_(stats, t);
+    }
+    struct ftr_stats* e = &ftr_stats_exited_;
+    stats->creates += e->creates;
+    stats->completions += e->completions;
+    stats->gets_ready += e->gets_ready;
+    stats->gets_blocked += e->gets_blocked;
+    stats->timeouts += e->timeouts;
+    for (size_t i = 0; i < ftr_stats_buckets; i++) {
+        stats->latency[i] += e->latency[i];
+    }
+    mtx_unlock(&ftr_stats_mtx_);
+#endif
+}
+
+static int ftr_init_header_(struct ftr_header* fh, size_t vsize, size_t value_offs, uint32_t flags) {
+    atomic_init(&fh->state, ftr_pending);
+    atomic_init(&fh->refs, 1);
+    atomic_init(&fh->continuations, NULL);
+    fh->flags = flags;
+    fh->spins = ftr_spin_inherit;
+    fh->error = 0;
+    fh->value_size = vsize;
+    fh->value_offs = value_offs;
+#ifndef ftr_has_pshared_
+    if (flags & ftr_flag_pshared) {
+        return ftr_error;
+    }
+#endif
+#ifndef ftr_use_futex
+    if (flags & ftr_flag_pshared) {
+        return ftr_success; // Parks on the state word, see ftr_wait_slow_
+    }
+    if (cnd_init(&fh->cvar)) {
+        return ftr_error;
+    }
+    if (mtx_init(&fh->mtx, mtx_plain)) {
+        return ftr_error;
+    }
+#endif
+    return ftr_success;
+}
+
+int ftr_init_(struct ftr_header* fh, size_t vsize, size_t value_offs, uint32_t flags) {
+    ftr_stat_(creates);
+    int err = ftr_init_header_(fh, vsize, value_offs, flags);
+    if (!err) {
+        ftr_trace_(create, fh, 0);
+    }
+    return err;
+}
+
+struct ftr_header* ftr_new_(size_t wholesize, size_t vsize, size_t value_offs, uint32_t flags) {
+#ifdef ftr_cache_align
+    // wholesize is already a multiple of the line, which aligned_alloc requires.
+    struct ftr_header* fh = aligned_alloc(ftr_cacheline, wholesize);
+    if (fh) {
+        memset(fh, 0, wholesize);
+    }
+#else
+    struct ftr_header* fh = calloc(1, wholesize);
+#endif
+    if (!fh) {
+        return NULL;
+    }
+    int err = ftr_init_(fh, vsize, value_offs, flags);
+    if (err) {
+        fprintf(stderr, "error initializing future: %s", ftr_errorstr(err));
+        return NULL;
+    }
+    return fh;
+}
+
+static void ftr_destroy_header_(struct ftr_header* fh) {
+    atomic_store_explicit(&fh->state, ftr_consumed, memory_order_relaxed);
+#ifndef ftr_use_futex
+    if (!(fh->flags & ftr_flag_pshared)) {
+        cnd_destroy(&fh->cvar);
+        mtx_destroy(&fh->mtx);
+    }
+#endif
+}
+
+void ftr_destroy_(struct ftr_header* fh) {
+    ftr_trace_(destroy, fh, 0);
+    ftr_destroy_header_(fh);
+}
+
+void ftr_ref_(struct ftr_header* fh) {
+    atomic_fetch_add_explicit(&fh->refs, 1, memory_order_relaxed);
+}
+
+static struct ftr_pool* ftr_pool_of_(struct ftr_header* fh);
+
+struct ftr_deferred_ {
+    ftr_task_fn fn;
+    void* arg;
+    struct ftr_deferred_* next; // In its executor's idle queue
+    ftr_alignas_(ftr_align_) uint8_t future[];
+};
+
+static struct ftr_deferred_* ftr_deferred_of_(struct ftr_header* fh) {
+    return (struct ftr_deferred_*)((uint8_t*)fh - offsetof(struct ftr_deferred_, future));
+}
+
+// Produces a deferred future on the calling thread, unless another thread already is (or did).
+static void ftr_deferred_run_(struct ftr_header* fh) {
+    if (ftr_claim_(fh) == ftr_success) {
+        struct ftr_deferred_* d = ftr_deferred_of_(fh);
+        d->fn(d->arg, (uint8_t*)fh + fh->value_offs);
+        ftr_complete_(fh);
+    }
+}
+
+// Waiting on a deferred future is what runs it. Returns the state afterwards.
+static uint32_t ftr_demand_(struct ftr_header* fh) {
+    ftr_deferred_run_(fh);
+    return atomic_load_explicit(&fh->state, memory_order_acquire);
+}
+
+void ftr_delete_(struct ftr_header* fh) {
+    if (fh->flags & ftr_flag_pooled) {
+        ftr_pool_release_(ftr_pool_of_(fh), fh);
+        return;
+    }
+    if (fh->flags & ftr_flag_array) {
+        // Owned by the array (see ftr_delete_array_), which keeps the last reference. Others
+        // (continuations, ftr_when_*, ftr_timeout) are still dropped, or ftr_reset_ fails.
+        unsigned refs = atomic_load_explicit(&fh->refs, memory_order_relaxed);
+        while (refs > 1 && !atomic_compare_exchange_weak_explicit(&fh->refs, &refs, refs - 1, memory_order_acq_rel, memory_order_relaxed)) {}
+        return;
+    }
+
+    // The last holder of a shared future frees it.
+    if (atomic_fetch_sub_explicit(&fh->refs, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+    bool deferred = fh->flags & ftr_flag_deferred;
+    ftr_destroy_(fh);
+    free(deferred ? (void*)ftr_deferred_of_(fh) : (void*)fh);
+}
+
+void ftr_now(struct timespec* ts) {
+#if defined(_WIN32)
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER counter;
+    if (!freq.QuadPart) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&counter);
+    ts->tv_sec = (time_t)(counter.QuadPart / freq.QuadPart);
+    ts->tv_nsec = (long)((counter.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart);
+#else
+    clock_gettime(CLOCK_MONOTONIC, ts);
+#endif
+}
+
+static void ftr_timespec_add_ns_(struct timespec* ts, int64_t ns) {
+    int64_t nsec = ts->tv_nsec + ns % 1000000000;
+    ts->tv_sec += (time_t)(ns / 1000000000);
+    if (nsec >= 1000000000) {
+        nsec -= 1000000000;
+        ts->tv_sec++;
+    } else if (nsec < 0) {
+        nsec += 1000000000;
+        ts->tv_sec--;
+    }
+    ts->tv_nsec = (long)nsec;
+}
+
+void ftr_deadline_in(struct timespec* deadline, int64_t timeout_us) {
+    ftr_now(deadline);
+    ftr_timespec_add_ns_(deadline, timeout_us * 1000);
+}
+
+// Nanoseconds left until the deadline, <= 0 once it has passed.
+static int64_t ftr_remaining_ns_(const struct timespec* deadline) {
+    struct timespec now;
+    ftr_now(&now);
+    return (int64_t)(deadline->tv_sec - now.tv_sec) * 1000000000 + (deadline->tv_nsec - now.tv_nsec);
+}
+
+#if defined(ftr_use_futex) || defined(ftr_has_pshared_)
+
+// Sleeps while fh->state == expected, until woken or the absolute monotonic deadline passes.
+static int ftr_futex_wait_(struct ftr_header* fh, uint32_t expected, const struct timespec* deadline) {
+#if defined(__linux__)
+    // FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC timeout, same clock as ftr_now.
+    // The private ops are cheaper, but only match waiters of the same process.
+    int op = (fh->flags & ftr_flag_pshared) ? FUTEX_WAIT_BITSET : FUTEX_WAIT_BITSET_PRIVATE;
+    long r = syscall(SYS_futex, &fh->state, op, expected, deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+    if (r == -1 && errno == ETIMEDOUT) {
+        return ftr_timedout;
+    }
+    return ftr_success; // Woken, EAGAIN (state changed) or EINTR: caller re-checks
+#else
+    int64_t remaining_us = ftr_remaining_ns_(deadline) / 1000;
+    if (remaining_us <= 0) {
+        return ftr_timedout;
+    }
+#if defined(_WIN32)
+    if (!WaitOnAddress((volatile void*)&fh->state, &expected, sizeof(expected), (DWORD)((remaining_us + 999) / 1000))) {
+        return (GetLastError() == ERROR_TIMEOUT) ? ftr_timedout : ftr_success;
+    }
+#elif defined(__APPLE__)
+    if (remaining_us > UINT32_MAX) {
+        remaining_us = UINT32_MAX;
+    }
+    uint32_t op = (fh->flags & ftr_flag_pshared) ? UL_COMPARE_AND_WAIT_SHARED : UL_COMPARE_AND_WAIT;
+    __ulock_wait(op, (void*)&fh->state, expected, (uint32_t)remaining_us);
+#endif
+    return ftr_success;
+#endif
+}
+
+static void ftr_futex_wake_(struct ftr_header* fh) {
+#if defined(__linux__)
+    syscall(SYS_futex, &fh->state, (fh->flags & ftr_flag_pshared) ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+#elif defined(_WIN32)
+    WakeByAddressAll((void*)&fh->state);
+#elif defined(__APPLE__)
+    uint32_t op = (fh->flags & ftr_flag_pshared) ? UL_COMPARE_AND_WAIT_SHARED : UL_COMPARE_AND_WAIT;
+    __ulock_wake(op | ULF_WAKE_ALL, (void*)&fh->state, 0);
+#endif
+}
+
+// Parks on the state word itself, see ftr_wait_slow_.
+static int ftr_wait_futex_(struct ftr_header* fh, const struct timespec* deadline) {
+    uint32_t s;
+    for (;;) {
+        s = atomic_load_explicit(&fh->state, memory_order_acquire);
+        if ((s & ftr_state_mask) >= ftr_ready) {
+            return ftr_success;
+        }
+        if (!(s & ftr_state_waiters)) {
+            if (!atomic_compare_exchange_weak(&fh->state, &s, s | ftr_state_waiters)) {
+                continue;
+            }
+            s |= ftr_state_waiters;
+        }
+        if (ftr_futex_wait_(fh, s, deadline) == ftr_timedout) {
+            s = atomic_load_explicit(&fh->state, memory_order_acquire);
+            return ((s & ftr_state_mask) >= ftr_ready) ? ftr_success : ftr_timedout;
+        }
+    }
+}
+
+#endif
+
+// Parks the calling thread until the future is no longer pending/completing.
+static int ftr_wait_slow_(struct ftr_header* fh, const struct timespec* deadline) {
+#ifdef ftr_use_futex
+    return ftr_wait_futex_(fh, deadline);
+#else
+#ifdef ftr_has_pshared_
+    if (fh->flags & ftr_flag_pshared) {
+        return ftr_wait_futex_(fh, deadline);
+    }
+#endif
+    uint32_t s;
+    mtx_lock(&fh->mtx);
+    for (;;) {
+        s = atomic_load_explicit(&fh->state, memory_order_acquire);
+        if ((s & ftr_state_mask) >= ftr_ready) {
+            break;
+        }
+
+        // Announce ourselves so ftr_complete_ knows it has to signal. This is done
+        // with the mutex held, so the completer can't broadcast before we're parked.
+        if (!(s & ftr_state_waiters) &&
+            !atomic_compare_exchange_weak(&fh->state, &s, s | ftr_state_waiters)) {
+            continue;
+        }
+
+        // cnd_timedwait only takes TIME_UTC, so the remaining monotonic time is converted on
+        // every round. If the wall clock jumps we wake early or late and re-check here.
+        int64_t remaining = ftr_remaining_ns_(deadline);
+        if (remaining <= 0) {
+            mtx_unlock(&fh->mtx);
+            return ftr_timedout;
+        }
+        struct timespec utc;
+        timespec_get(&utc, TIME_UTC);
+        ftr_timespec_add_ns_(&utc, remaining);
+
+        int err = cnd_timedwait(&fh->cvar, &fh->mtx, &utc);
+        if (err && err != thrd_timedout) {
+            mtx_unlock(&fh->mtx);
+            return ftr_error;
+        }
+    }
+
+    mtx_unlock(&fh->mtx);
+    return ftr_success;
+#endif
+}
+
+// Wakes every thread parked in ftr_wait_slow_.
+static void ftr_wake_(struct ftr_header* fh) {
+#ifdef ftr_use_futex
+    ftr_futex_wake_(fh);
+#else
+#ifdef ftr_has_pshared_
+    if (fh->flags & ftr_flag_pshared) {
+        ftr_futex_wake_(fh);
+        return;
+    }
+#endif
+    mtx_lock(&fh->mtx);
+    cnd_broadcast(&fh->cvar);
+    mtx_unlock(&fh->mtx);
+#endif
+}
+
+/**
+ * Events are headers whose state is a signal count in the generation bits plus
+ * ftr_state_waiters. A waiter reads the state, re-checks its condition after setting
+ * the waiters flag, and parks until the state changes. Signalers only touch the state
+ * (and wake) when the flag is set.
+ */
+static int ftr_event_wait_(struct ftr_header* ev, uint32_t seen, const struct timespec* deadline) {
+#ifdef ftr_use_futex
+    return ftr_futex_wait_(ev, seen, deadline);
+#else
+    int result = ftr_success;
+    mtx_lock(&ev->mtx);
+    while (atomic_load_explicit(&ev->state, memory_order_acquire) == seen) {
+        int64_t remaining = ftr_remaining_ns_(deadline);
+        if (remaining <= 0) {
+            result = ftr_timedout;
+            break;
+        }
+        struct timespec utc;
+        timespec_get(&utc, TIME_UTC);
+        ftr_timespec_add_ns_(&utc, remaining);
+
+        int err = cnd_timedwait(&ev->cvar, &ev->mtx, &utc);
+        if (err && err != thrd_timedout) {
+            result = ftr_error;
+            break;
+        }
+    }
+    mtx_unlock(&ev->mtx);
+    return result;
+#endif
+}
+
+static void ftr_event_signal_(struct ftr_header* ev) {
+    // Pairs with the waiter setting the flag before re-checking its condition.
+    atomic_thread_fence(memory_order_seq_cst);
+    uint32_t s = atomic_load_explicit(&ev->state, memory_order_relaxed);
+    do {
+        if (!(s & ftr_state_waiters)) { return; }
+    } while (!atomic_compare_exchange_weak(&ev->state, &s, (s + (1u << ftr_state_gen_shift)) & ~ftr_state_waiters));
+    ftr_wake_(ev);
+}
+
+static atomic_uint ftr_spins_ = ftr_default_spins;
+static atomic_uint ftr_yields_ = ftr_default_yields;
+
+static atomic_uint_fast64_t ftr_waits_spun_;
+static atomic_uint_fast64_t ftr_waits_yielded_;
+static atomic_uint_fast64_t ftr_waits_parked_;
+
+static inline void ftr_cpu_relax_(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+void ftr_set_default_spin(uint32_t spins, uint32_t yields) {
+    atomic_store_explicit(&ftr_spins_, spins, memory_order_relaxed);
+    atomic_store_explicit(&ftr_yields_, yields, memory_order_relaxed);
+}
+
+void ftr_get_wait_stats(struct ftr_wait_stats* stats) {
+    stats->spun = atomic_load_explicit(&ftr_waits_spun_, memory_order_relaxed);
+    stats->yielded = atomic_load_explicit(&ftr_waits_yielded_, memory_order_relaxed);
+    stats->parked = atomic_load_explicit(&ftr_waits_parked_, memory_order_relaxed);
+}
+
+// Result of waiting on a future that is done.
+static inline int ftr_done_(struct ftr_header* fh, uint32_t s) {
+    switch (s & ftr_state_mask) {
+    case ftr_cancelled_state: return ftr_cancelled;
+    case ftr_failed_state:    return fh->error;
+    default:                  return ftr_success;
+    }
+}
+
+int ftr_wait_(struct ftr_header* fh, int32_t timeout_ms) {
+    // Fast path: a published future is observed without parking.
+    uint32_t s = atomic_load_explicit(&fh->state, memory_order_acquire);
+    if ((s & ftr_state_mask) >= ftr_ready) {
+        return ftr_done_(fh, s);
+    }
+    if ((fh->flags & ftr_flag_deferred) && ((s = ftr_demand_(fh)) & ftr_state_mask) >= ftr_ready) {
+        return ftr_done_(fh, s);
+    }
+    if (timeout_ms == 0) {
+        return ftr_timedout;
+    }
+
+    struct timespec deadline;
+    ftr_deadline_in(&deadline, (int64_t)timeout_ms * 1000);
+    return ftr_wait_until_(fh, &deadline);
+}
+
+int ftr_wait_us_(struct ftr_header* fh, int64_t timeout_us) {
+    uint32_t s = atomic_load_explicit(&fh->state, memory_order_acquire);
+    if ((s & ftr_state_mask) >= ftr_ready) {
+        return ftr_done_(fh, s);
+    }
+    if ((fh->flags & ftr_flag_deferred) && ((s = ftr_demand_(fh)) & ftr_state_mask) >= ftr_ready) {
+        return ftr_done_(fh, s);
+    }
+    if (timeout_us == 0) {
+        return ftr_timedout;
+    }
+
+    struct timespec deadline;
+    ftr_deadline_in(&deadline, timeout_us);
+    return ftr_wait_until_(fh, &deadline);
+}
+
+// Spins, yields and parks until the pending future is done or the deadline passes.
+static int ftr_wait_pending_(struct ftr_header* fh, const struct timespec* deadline) {
+    uint32_t s;
+
+    // Short handoffs are cheaper to catch spinning than with a sleep/wake round-trip.
+    uint32_t spins = (fh->spins == ftr_spin_inherit) ? atomic_load_explicit(&ftr_spins_, memory_order_relaxed) : fh->spins;
+    for (uint32_t i = 0; i < spins; i++) {
+        ftr_cpu_relax_();
+        s = atomic_load_explicit(&fh->state, memory_order_acquire);
+        if ((s & ftr_state_mask) >= ftr_ready) {
+            atomic_fetch_add_explicit(&ftr_waits_spun_, 1, memory_order_relaxed);
+            return ftr_done_(fh, s);
+        }
+    }
+    uint32_t yields = atomic_load_explicit(&ftr_yields_, memory_order_relaxed);
+    for (uint32_t i = 0; i < yields; i++) {
+        thrd_yield();
+        s = atomic_load_explicit(&fh->state, memory_order_acquire);
+        if ((s & ftr_state_mask) >= ftr_ready) {
+            atomic_fetch_add_explicit(&ftr_waits_yielded_, 1, memory_order_relaxed);
+            return ftr_done_(fh, s);
+        }
+    }
+    atomic_fetch_add_explicit(&ftr_waits_parked_, 1, memory_order_relaxed);
+
+    int err = ftr_wait_slow_(fh, deadline);
+    if (err != ftr_success) {
+        return err;
+    }
+    return ftr_done_(fh, atomic_load_explicit(&fh->state, memory_order_acquire));
+}
+
+int ftr_wait_until_(struct ftr_header* fh, const struct timespec* deadline) {
+    uint32_t s = atomic_load_explicit(&fh->state, memory_order_acquire);
+    if ((s & ftr_state_mask) >= ftr_ready) {
+        return ftr_done_(fh, s);
+    }
+    if ((fh->flags & ftr_flag_deferred) && ((s = ftr_demand_(fh)) & ftr_state_mask) >= ftr_ready) {
+        return ftr_done_(fh, s);
+    }
+    if (ftr_remaining_ns_(deadline) <= 0) {
+        return ftr_timedout;
+    }
+
+    ftr_trace_(wait_begin, fh, 0);
+    int err = ftr_wait_pending_(fh, deadline);
+    ftr_trace_(wait_end, fh, err);
+    return err;
+}
+
+// Copies the value of a ready future to dest. Only one consumer gets to read it, unless the future is shared.
+static int ftr_take_(struct ftr_header* fh, void* dest) {
+    if (!(fh->flags & ftr_flag_shared)) {
+        uint32_t s = atomic_load_explicit(&fh->state, memory_order_relaxed);
+        do {
+            if ((s & ftr_state_mask) != ftr_ready) { return ftr_invalid; }
+        } while (!atomic_compare_exchange_weak_explicit(&fh->state, &s, (s & ftr_state_gen_mask) | ftr_consumed,
+                                                        memory_order_acquire, memory_order_relaxed));
+    }
+
+    void* src = (void*)((uint8_t*)(fh) + fh->value_offs);
+    memcpy(dest, src, fh->value_size);
+    ftr_stat_consumed_(fh);
+
+    return ftr_success;
+}
+
+int ftr_get_(struct ftr_header* fh, int32_t timeout_ms, void* dest, size_t dest_size, size_t check) {
+    (void)check;
+
+    if ((atomic_load_explicit(&fh->state, memory_order_relaxed) & ftr_state_mask) == ftr_consumed) {
+        return ftr_invalid;
+    }
+
+    if (dest_size != fh->value_size) {
+        return ftr_destsize;
+    }
+
+    ftr_stat_get_(fh);
+    int err = ftr_wait_(fh, timeout_ms);
+    if (err != ftr_success) {
+        if (err == ftr_timedout) { ftr_stat_(timeouts); }
+        return err;
+    }
+
+    return ftr_take_(fh, dest);
+}
+
+int ftr_get_until_(struct ftr_header* fh, const struct timespec* deadline, void* dest, size_t dest_size, size_t check) {
+    (void)check;
+
+    if ((atomic_load_explicit(&fh->state, memory_order_relaxed) & ftr_state_mask) == ftr_consumed) {
+        return ftr_invalid;
+    }
+
+    if (dest_size != fh->value_size) {
+        return ftr_destsize;
+    }
+
+    ftr_stat_get_(fh);
+    int err = ftr_wait_until_(fh, deadline);
+    if (err != ftr_success) {
+        if (err == ftr_timedout) { ftr_stat_(timeouts); }
+        return err;
+    }
+
+    return ftr_take_(fh, dest);
+}
+
+int ftr_peek_(struct ftr_header* fh, int32_t timeout_ms, const void** out, size_t check) {
+    (void)check;
+
+    int err = ftr_wait_(fh, timeout_ms);
+    if (err != ftr_success) {
+        return err;
+    }
+
+    // The value is immutable once published, so any number of readers can borrow it.
+    *out = (const void*)((const uint8_t*)(fh) + fh->value_offs);
+    return ftr_success;
+}
+
+int ftr_claim_(struct ftr_header* fh) {
+    uint32_t s = atomic_load_explicit(&fh->state, memory_order_relaxed);
+    do {
+        if ((s & ftr_state_mask) != ftr_pending) { return ftr_invalid; }
+    } while (!atomic_compare_exchange_weak_explicit(&fh->state, &s, (s & ~ftr_state_mask) | ftr_completing,
+                                                    memory_order_acquire, memory_order_relaxed));
+    return ftr_success;
+}
+
+static void ftr_run_continuations_(struct ftr_header* fh);
+
+int ftr_claim_error_(struct ftr_header* fh) {
+    uint32_t s = atomic_load_explicit(&fh->state, memory_order_relaxed);
+    return ((s & ftr_state_mask) == ftr_cancelled_state) ? ftr_cancelled : ftr_invalid;
+}
+
+uint32_t ftr_generation_(struct ftr_header* fh) {
+    return atomic_load_explicit(&fh->state, memory_order_relaxed) >> ftr_state_gen_shift;
+}
+
+// Like ftr_claim_, as a single CAS that also checks the generation.
+int ftr_claim_gen_(struct ftr_header* fh, uint32_t gen) {
+    uint32_t s = atomic_load_explicit(&fh->state, memory_order_relaxed);
+    do {
+        if ((s & ftr_state_mask) != ftr_pending || (s >> ftr_state_gen_shift) != gen) { return ftr_invalid; }
+    } while (!atomic_compare_exchange_weak_explicit(&fh->state, &s, (s & ~ftr_state_mask) | ftr_completing,
+                                                    memory_order_acquire, memory_order_relaxed));
+    return ftr_success;
+}
+
+int ftr_claim_gen_error_(struct ftr_header* fh, uint32_t gen) {
+    return (ftr_generation_(fh) != gen) ? ftr_invalid : ftr_claim_error_(fh);
+}
+
+// Makes a done future pending again in the next generation.
+static void ftr_rearm_(struct ftr_header* fh, uint32_t s) {
+    atomic_store_explicit(&fh->continuations, NULL, memory_order_relaxed);
+    fh->error = 0;
+    atomic_store_explicit(&fh->state, ((s & ftr_state_gen_mask) + (1u << ftr_state_gen_shift)) | ftr_pending,
+                          memory_order_release);
+}
+
+int ftr_reset_(struct ftr_header* fh) {
+    uint32_t s = atomic_load_explicit(&fh->state, memory_order_acquire);
+    if ((s & ftr_state_mask) < ftr_ready) {
+        return ftr_invalid; // Still pending, or a producer is writing the value
+    }
+
+    // Continuations, executor tasks and notifiers hold a reference until they're done with it.
+    if (atomic_load_explicit(&fh->refs, memory_order_acquire) != 1) {
+        return ftr_invalid;
+    }
+
+    ftr_rearm_(fh, s);
+    return ftr_success;
+}
+
+int ftr_cancel_(struct ftr_header* fh) {
+    uint32_t s = atomic_load_explicit(&fh->state, memory_order_relaxed);
+    do {
+        if ((s & ftr_state_mask) != ftr_pending) { return ftr_invalid; }
+    } while (!atomic_compare_exchange_weak_explicit(&fh->state, &s, (s & ftr_state_gen_mask) | ftr_cancelled_state,
+                                                    memory_order_acq_rel, memory_order_relaxed));
+
+    ftr_trace_(complete, fh, ftr_cancelled);
+    if (s & ftr_state_waiters) {
+        ftr_wake_(fh);
+    }
+    ftr_run_continuations_(fh);
+
+    return ftr_success;
+}
+
+int ftr_fail_(struct ftr_header* fh, int code) {
+    if (code <= 0 || code > ftr_max_error_code) {
+        return ftr_invalid;
+    }
+    // Claimed like ftr_complete, so the code is written and published by a single thread.
+    if (ftr_claim_(fh)) {
+        return ftr_claim_error_(fh);
+    }
+    return ftr_fail_claimed_(fh, code);
+}
+
+int ftr_fail_claimed_(struct ftr_header* fh, int code) {
+    uint32_t s = atomic_load_explicit(&fh->state, memory_order_relaxed);
+    if ((s & ftr_state_mask) != ftr_completing || code <= 0 || code > ftr_max_error_code) {
+        return ftr_invalid;
+    }
+    fh->error = code;
+    ftr_stat_(completions);
+
+    s = atomic_exchange(&fh->state, (s & ftr_state_gen_mask) | ftr_failed_state);
+    ftr_trace_(complete, fh, code);
+    if (s & ftr_state_waiters) {
+        ftr_wake_(fh);
+    }
+    ftr_run_continuations_(fh);
+
+    return ftr_success;
+}
+
+int ftr_complete_(struct ftr_header* fh) {
+    uint32_t s = atomic_load_explicit(&fh->state, memory_order_relaxed);
+    if ((s & ftr_state_mask) != ftr_completing) { return ftr_invalid; }
+
+    // Publish, and only issue a wakeup if someone is parked. Nothing else changes the
+    // generation while the future is being completed.
+    ftr_stat_completed_(fh);
+    s = atomic_exchange(&fh->state, (s & ftr_state_gen_mask) | ftr_ready);
+    ftr_trace_(complete, fh, ftr_success);
+    if (s & ftr_state_waiters) {
+        ftr_wake_(fh);
+    }
+    ftr_run_continuations_(fh);
+
+    return ftr_success;
+}
+
+int ftr_complete_ptr_(struct ftr_header* fh, const void* src, size_t src_size, size_t check) {
+    (void)check;
+
+    if (src_size != fh->value_size) {
+        return ftr_destsize;
+    }
+    if (ftr_claim_(fh)) {
+        return ftr_claim_error_(fh);
+    }
+
+    void* dest = (void*)((uint8_t*)(fh) + fh->value_offs);
+    memcpy(dest, src, fh->value_size);
+
+    return ftr_complete_(fh);
+}
+
+int ftr_complete_batch_(struct ftr_header** futures, const void* values, size_t value_size, size_t n, size_t check) {
+    (void)check;
+
+    int result = ftr_success;
+    const uint8_t* src = values;
+
+    // In chunks of 64, so which futures we claimed and which need a wakeup fit in a word each.
+    for (size_t base = 0; base < n; base += 64) {
+        size_t count = n - base < 64 ? n - base : 64;
+        uint64_t claimed = 0;
+        uint64_t waited = 0;
+
+        for (size_t i = 0; i < count; i++) {
+            struct ftr_header* fh = futures[base + i];
+            int err = value_size != fh->value_size ? ftr_destsize
+                    : ftr_claim_(fh) ? ftr_claim_error_(fh) : ftr_success;
+            if (err) {
+                if (!result) { result = err; }
+                continue;
+            }
+            memcpy((uint8_t*)fh + fh->value_offs, src + (base + i) * value_size, value_size);
+            ftr_stat_completed_(fh);
+            claimed |= UINT64_C(1) << i;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            if (claimed & (UINT64_C(1) << i)) {
+                struct ftr_header* fh = futures[base + i];
+                uint32_t s = atomic_load_explicit(&fh->state, memory_order_relaxed);
+                s = atomic_exchange(&fh->state, (s & ftr_state_gen_mask) | ftr_ready);
+                ftr_trace_(complete, fh, ftr_success);
+                if (s & ftr_state_waiters) { waited |= UINT64_C(1) << i; }
+            }
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            if (waited & (UINT64_C(1) << i)) { ftr_wake_(futures[base + i]); }
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            if (claimed & (UINT64_C(1) << i)) { ftr_run_continuations_(futures[base + i]); }
+        }
+    }
+
+    return result;
+}
+
+struct ftr_header* ftr_new_array_(size_t wholesize, size_t vsize, size_t value_offs, size_t n) {
+    size_t stride = ftr_array_stride(wholesize);
+    if (!n || n > SIZE_MAX / stride) {
+        return NULL;
+    }
+
+    uint8_t* block = aligned_alloc(ftr_cacheline, n * stride);
+    if (!block) {
+        return NULL;
+    }
+    memset(block, 0, n * stride);
+
+    for (size_t i = 0; i < n; i++) {
+        int err = ftr_init_((struct ftr_header*)(block + i * stride), vsize, value_offs, ftr_flag_array);
+        if (err) {
+            fprintf(stderr, "error initializing future: %s", ftr_errorstr(err));
+            ftr_delete_array_((struct ftr_header*)block, stride, i);
+            return NULL;
+        }
+    }
+    return (struct ftr_header*)block;
+}
+
+void ftr_delete_array_(struct ftr_header* first, size_t stride, size_t n) {
+    uint8_t* block = (uint8_t*)first;
+    for (size_t i = 0; i < n; i++) {
+        ftr_destroy_((struct ftr_header*)(block + i * stride));
+    }
+    free(block);
+}
+
+struct ftr_pool_slot {
+    struct ftr_pool_slot* next;
+    struct ftr_pool* pool;
+    ftr_alignas_(ftr_align_) uint8_t future[];
+};
+
+struct ftr_pool_slab {
+    struct ftr_pool_slab* next;
+    size_t count;
+    ftr_alignas_(ftr_align_) uint8_t slots[];
+};
+
+#ifndef ftr_pool_cache_slots
+#define ftr_pool_cache_slots 4 // Pools a thread can cache slots for at the same time
+#endif
+
+#ifndef ftr_pool_cache_batch
+#define ftr_pool_cache_batch 32 // Slots moved between a thread cache and its pool at once
+#endif
+
+struct ftr_pool_cache {
+    struct ftr_pool* pool;
+    uint64_t id;
+    struct ftr_pool_slot* list;
+    size_t count;
+};
+
+static _Thread_local struct ftr_pool_cache ftr_pool_caches_[ftr_pool_cache_slots];
+
+static atomic_uint_fast64_t ftr_pool_next_id_ = 1;
+
+// Ids of the pools not destroyed yet, so threads can let go of caches for the others.
+static once_flag ftr_pool_live_once_ = ONCE_FLAG_INIT;
+static mtx_t ftr_pool_live_mtx_;
+static uint64_t* ftr_pool_live_;
+static size_t ftr_pool_nlive_;
+static size_t ftr_pool_live_capacity_;
+static atomic_uint_fast64_t ftr_pool_destroys_; // Bumped by every ftr_pool_destroy
+static _Thread_local uint_fast64_t ftr_pool_swept_; // ftr_pool_destroys_ as of this thread's last sweep
+
+static void ftr_pool_live_init_(void) {
+    mtx_init(&ftr_pool_live_mtx_, mtx_plain);
+}
+
+static int ftr_pool_live_add_(uint64_t id) {
+    call_once(&ftr_pool_live_once_, ftr_pool_live_init_);
+    mtx_lock(&ftr_pool_live_mtx_);
+    if (ftr_pool_nlive_ == ftr_pool_live_capacity_) {
+        size_t capacity = ftr_pool_live_capacity_ ? 2 * ftr_pool_live_capacity_ : 8;
+        uint64_t* live = realloc(ftr_pool_live_, capacity * sizeof(uint64_t));
+        if (!live) {
+            mtx_unlock(&ftr_pool_live_mtx_);
+            return ftr_nomem;
+        }
+        ftr_pool_live_ = live;
+        ftr_pool_live_capacity_ = capacity;
+    }
+    ftr_pool_live_[ftr_pool_nlive_++] = id;
+    mtx_unlock(&ftr_pool_live_mtx_);
+    return ftr_success;
+}
+
+static void ftr_pool_live_remove_(uint64_t id) {
+    call_once(&ftr_pool_live_once_, ftr_pool_live_init_);
+    mtx_lock(&ftr_pool_live_mtx_);
+    for (size_t i = 0; i < ftr_pool_nlive_; i++) {
+        if (ftr_pool_live_[i] == id) {
+            ftr_pool_live_[i] = ftr_pool_live_[--ftr_pool_nlive_];
+            break;
+        }
+    }
+    if (!ftr_pool_nlive_) {
+        free(ftr_pool_live_);
+        ftr_pool_live_ = NULL;
+        ftr_pool_live_capacity_ = 0;
+    }
+    mtx_unlock(&ftr_pool_live_mtx_);
+    atomic_fetch_add_explicit(&ftr_pool_destroys_, 1, memory_order_release);
+}
+
+// Clears this thread's caches for pools destroyed since the last sweep, their slots are gone.
+// Returns whether an entry was freed.
+static bool ftr_pool_cache_sweep_(void) {
+    uint_fast64_t destroys = atomic_load_explicit(&ftr_pool_destroys_, memory_order_acquire);
+    if (destroys == ftr_pool_swept_) {
+        return false;
+    }
+    ftr_pool_swept_ = destroys;
+
+    bool freed = false;
+    mtx_lock(&ftr_pool_live_mtx_); // Initialized: some pool was destroyed
+    for (size_t i = 0; i < ftr_pool_cache_slots; i++) {
+        struct ftr_pool_cache* c = &ftr_pool_caches_[i];
+        bool live = false;
+        for (size_t j = 0; c->pool && !live && j < ftr_pool_nlive_; j++) {
+            live = ftr_pool_live_[j] == c->id;
+        }
+        if (c->pool && !live) {
+            memset(c, 0, sizeof(struct ftr_pool_cache));
+            freed = true;
+        }
+    }
+    mtx_unlock(&ftr_pool_live_mtx_);
+    return freed;
+}
+
+static struct ftr_pool* ftr_pool_of_(struct ftr_header* fh) {
+    struct ftr_pool_slot* slot = (struct ftr_pool_slot*)((uint8_t*)fh - offsetof(struct ftr_pool_slot, future));
+    return slot->pool;
+}
+
+// Finds (or claims) this thread's cache for the pool, NULL if all cache entries are taken.
+static struct ftr_pool_cache* ftr_pool_cache_(struct ftr_pool* pool) {
+    struct ftr_pool_cache* unused = NULL;
+    for (size_t i = 0; i < ftr_pool_cache_slots; i++) {
+        struct ftr_pool_cache* c = &ftr_pool_caches_[i];
+        if (c->pool == pool) {
+            if (c->id != pool->id) {
+                // Left over from a destroyed pool at the same address, its slots are gone.
+                c->id = pool->id;
+                c->list = NULL;
+                c->count = 0;
+            }
+            return c;
+        }
+        if (!c->pool && !unused) {
+            unused = c;
+        }
+    }
+    if (!unused && ftr_pool_cache_sweep_()) {
+        for (size_t i = 0; i < ftr_pool_cache_slots && !unused; i++) {
+            unused = ftr_pool_caches_[i].pool ? NULL : &ftr_pool_caches_[i];
+        }
+    }
+    if (unused) {
+        unused->pool = pool;
+        unused->id = pool->id;
+        unused->list = NULL;
+        unused->count = 0;
+    }
+    return unused;
+}
+
+#if defined(__linux__)
+// Parses a sysfs CPU or node list ("0-3,8-11") into mask, returns one past its highest entry.
+static int ftr_numa_parse_(const char* path, unsigned long* mask, size_t words) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+    char buf[4096];
+    bool ok = fgets(buf, sizeof(buf), f) != NULL;
+    fclose(f);
+
+    const size_t bits = 8 * sizeof(unsigned long);
+    int end = 0;
+    for (char* p = buf; ok && *p >= '0' && *p <= '9';) {
+        unsigned long lo = strtoul(p, &p, 10);
+        unsigned long hi = lo;
+        if (*p == '-') {
+            hi = strtoul(p + 1, &p, 10);
+        }
+        for (unsigned long i = lo; i <= hi && i < words * bits; i++) {
+            mask[i / bits] |= 1UL << (i % bits);
+        }
+        end = (int)hi + 1 > end ? (int)hi + 1 : end;
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return end;
+}
+#endif
+
+int ftr_numa_nodes(void) {
+#if defined(__linux__)
+    static ftr_atomic(int) nodes;
+    int n = atomic_load_explicit(&nodes, memory_order_relaxed);
+    if (!n) {
+        n = ftr_numa_parse_("/sys/devices/system/node/online", NULL, 0);
+        n = n > 0 ? n : 1;
+        atomic_store_explicit(&nodes, n, memory_order_relaxed);
+    }
+    return n;
+#else
+    return 1;
+#endif
+}
+
+int ftr_numa_node(void) {
+#if defined(__linux__)
+    unsigned cpu = 0;
+    unsigned node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+        return (int)node;
+    }
+#endif
+    return 0;
+}
+
+// Fills mask with the CPUs of `node` and returns how many there are.
+static size_t ftr_numa_cpus_(int node, unsigned long* mask, size_t words) {
+    memset(mask, 0, words * sizeof(unsigned long));
+#if defined(__linux__)
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if (!ftr_numa_parse_(path, mask, words) && node == 0) {
+        // Kernels without NUMA support have no node directories, everything is node 0.
+        syscall(SYS_sched_getaffinity, 0, words * sizeof(unsigned long), mask);
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < words * 8 * sizeof(unsigned long); i++) {
+        count += (mask[i / (8 * sizeof(unsigned long))] >> (i % (8 * sizeof(unsigned long)))) & 1;
+    }
+    return count;
+#elif defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return node == 0 ? (size_t)info.dwNumberOfProcessors : 0;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return node == 0 ? (n > 0 ? (size_t)n : 1) : 0;
+#endif
+}
+
+// Memory policies apply to whole pages, so slabs of node-local pools get pages of their own.
+static size_t ftr_numa_align_(int node) {
+#if defined(__linux__)
+    long page = sysconf(_SC_PAGESIZE);
+    if (node >= 0 && page > (long)ftr_align_) {
+        return (size_t)page;
+    }
+#endif
+    (void)node;
+    return ftr_align_;
+}
+
+// Prefers `node` for the pages of [addr, addr + size). Best effort, on failure they stay put.
+static void ftr_numa_bind_(void* addr, size_t size, int node) {
+#if defined(__linux__)
+    const size_t bits = 8 * sizeof(unsigned long);
+    unsigned long nodes[ftr_numa_max_cpus / (8 * sizeof(unsigned long))] = {0};
+    if (node >= 0 && (size_t)node < ftr_numa_max_cpus) {
+        nodes[(size_t)node / bits] |= 1UL << ((size_t)node % bits);
+        // Pages already faulted in (reused heap memory) are moved as well.
+        syscall(SYS_mbind, addr, size, MPOL_PREFERRED, nodes, sizeof(nodes) * 8 + 1, MPOL_MF_MOVE);
+    }
+#else
+    (void)addr;
+    (void)size;
+    (void)node;
+#endif
+}
+
+// Allocates a slab and pushes its slots on the pool's free list. Called with pool->mtx held.
+static int ftr_pool_grow_(struct ftr_pool* pool) {
+    size_t size = sizeof(struct ftr_pool_slab) + pool->stride * pool->capacity;
+    size_t align = ftr_numa_align_(pool->node);
+    size = (size + align - 1) / align * align;
+    struct ftr_pool_slab* slab = aligned_alloc(align, size);
+    if (!slab) {
+        return ftr_nomem;
+    }
+    ftr_numa_bind_(slab, size, pool->node);
+    memset(slab->slots, 0, pool->stride * pool->capacity);
+    slab->count = 0;
+
+    for (size_t i = 0; i < pool->capacity; i++) {
+        struct ftr_pool_slot* slot = (struct ftr_pool_slot*)(slab->slots + i * pool->stride);
+        struct ftr_header* fh = (struct ftr_header*)slot->future;
+        int err = ftr_init_header_(fh, pool->value_size, pool->value_offs, ftr_flag_pooled);
+        if (err) {
+            break;
+        }
+        slot->pool = pool;
+        slot->next = pool->free_list;
+        pool->free_list = slot;
+        slab->count++;
+    }
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    return slab->count ? ftr_success : ftr_error;
+}
+
+struct ftr_pool* ftr_pool_create_(size_t wholesize, size_t vsize, size_t value_offs, size_t capacity, int node) {
+    struct ftr_pool* pool = calloc(1, sizeof(struct ftr_pool));
+    if (!pool) {
+        return NULL;
+    }
+    if (mtx_init(&pool->mtx, mtx_plain)) {
+        free(pool);
+        return NULL;
+    }
+
+    const size_t align = ftr_align_;
+    pool->id = atomic_fetch_add(&ftr_pool_next_id_, 1);
+    pool->wholesize = wholesize;
+    pool->value_size = vsize;
+    pool->value_offs = value_offs;
+    pool->stride = (offsetof(struct ftr_pool_slot, future) + wholesize + align - 1) / align * align;
+    pool->capacity = capacity ? capacity : 1;
+    pool->node = node;
+
+    if (ftr_pool_live_add_(pool->id) || ftr_pool_grow_(pool)) {
+        ftr_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void ftr_pool_destroy(struct ftr_pool* pool) {
+    // Only the calling thread's cache can be cleared here, other threads sweep theirs once
+    // they run out of entries, or notice the stale id if a new pool reuses the address.
+    for (size_t i = 0; i < ftr_pool_cache_slots; i++) {
+        if (ftr_pool_caches_[i].pool == pool) {
+            memset(&ftr_pool_caches_[i], 0, sizeof(struct ftr_pool_cache));
+        }
+    }
+    ftr_pool_live_remove_(pool->id);
+
+    struct ftr_pool_slab* slab = pool->slabs;
+    while (slab) {
+        struct ftr_pool_slab* next = slab->next;
+        for (size_t i = 0; i < slab->count; i++) {
+            struct ftr_pool_slot* slot = (struct ftr_pool_slot*)(slab->slots + i * pool->stride);
+            ftr_destroy_header_((struct ftr_header*)slot->future);
+        }
+        free(slab);
+        slab = next;
+    }
+
+    mtx_destroy(&pool->mtx);
+    free(pool);
+}
+
+static struct ftr_header* ftr_pool_take_(struct ftr_pool* pool) {
+    struct ftr_pool_cache* cache = ftr_pool_cache_(pool);
+    struct ftr_pool_slot* slot = NULL;
+
+    if (cache && cache->list) {
+        slot = cache->list;
+        cache->list = slot->next;
+        cache->count--;
+        return (struct ftr_header*)slot->future;
+    }
+
+    mtx_lock(&pool->mtx);
+    if (!pool->free_list && ftr_pool_grow_(pool)) {
+        mtx_unlock(&pool->mtx);
+        return NULL;
+    }
+    slot = pool->free_list;
+    pool->free_list = slot->next;
+
+    // Refill the thread cache while we hold the lock anyway.
+    if (cache) {
+        while (pool->free_list && cache->count < ftr_pool_cache_batch) {
+            struct ftr_pool_slot* s = pool->free_list;
+            pool->free_list = s->next;
+            s->next = cache->list;
+            cache->list = s;
+            cache->count++;
+        }
+    }
+    mtx_unlock(&pool->mtx);
+
+    return (struct ftr_header*)slot->future;
+}
+
+struct ftr_header* ftr_pool_acquire_(struct ftr_pool* pool) {
+    struct ftr_header* fh = ftr_pool_take_(pool);
+    if (fh) {
+        ftr_stat_(creates);
+        ftr_trace_(create, fh, 0);
+    }
+    return fh;
+}
+
+void ftr_pool_release_(struct ftr_pool* pool, struct ftr_header* fh) {
+    if (atomic_fetch_sub_explicit(&fh->refs, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+    ftr_trace_(destroy, fh, 0);
+
+    // Re-arm the future, its cnd/mtx stay initialized. The value is not cleared.
+    atomic_store_explicit(&fh->refs, 1, memory_order_relaxed);
+    ftr_rearm_(fh, atomic_load_explicit(&fh->state, memory_order_relaxed));
+
+    struct ftr_pool_slot* slot = (struct ftr_pool_slot*)((uint8_t*)fh - offsetof(struct ftr_pool_slot, future));
+    struct ftr_pool_cache* cache = ftr_pool_cache_(pool);
+    if (cache) {
+        slot->next = cache->list;
+        cache->list = slot;
+        cache->count++;
+        if (cache->count < 2 * ftr_pool_cache_batch) {
+            return;
+        }
+
+        // Too many cached, hand a batch back to the pool.
+        struct ftr_pool_slot* first = cache->list;
+        struct ftr_pool_slot* last = first;
+        for (size_t i = 1; i < ftr_pool_cache_batch; i++) {
+            last = last->next;
+        }
+        cache->list = last->next;
+        cache->count -= ftr_pool_cache_batch;
+
+        mtx_lock(&pool->mtx);
+        last->next = pool->free_list;
+        pool->free_list = first;
+        mtx_unlock(&pool->mtx);
+        return;
+    }
+
+    mtx_lock(&pool->mtx);
+    slot->next = pool->free_list;
+    pool->free_list = slot;
+    mtx_unlock(&pool->mtx);
+}
+
+static _Thread_local struct ftr_worker* ftr_current_worker_;
+
+static int ftr_worker_push_(struct ftr_worker* w, struct ftr_task task) {
+    mtx_lock(&w->mtx);
+    if (w->count == w->capacity) {
+        size_t capacity = w->capacity ? w->capacity * 2 : 64;
+        struct ftr_task* tasks = malloc(capacity * sizeof(struct ftr_task));
+        if (!tasks) {
+            mtx_unlock(&w->mtx);
+            return ftr_nomem;
+        }
+        for (size_t i = 0; i < w->count; i++) {
+            tasks[i] = w->tasks[(w->head + i) % w->capacity];
+        }
+        free(w->tasks);
+        w->tasks = tasks;
+        w->capacity = capacity;
+        w->head = 0;
+    }
+    w->tasks[(w->head + w->count) % w->capacity] = task;
+    w->count++;
+    mtx_unlock(&w->mtx);
+    return ftr_success;
+}
+
+static bool ftr_worker_pop_(struct ftr_worker* w, struct ftr_task* task, bool steal) {
+    mtx_lock(&w->mtx);
+    if (!w->count) {
+        mtx_unlock(&w->mtx);
+        return false;
+    }
+    if (steal) {
+        *task = w->tasks[w->head];
+        w->head = (w->head + 1) % w->capacity;
+    } else {
+        *task = w->tasks[(w->head + w->count - 1) % w->capacity];
+    }
+    w->count--;
+    mtx_unlock(&w->mtx);
+    return true;
+}
+
+static void ftr_task_run_(struct ftr_task* task) {
+    struct ftr_header* fh = task->future;
+    if (!fh) {
+        task->fn(task->arg, NULL);
+        return;
+    }
+    if (ftr_claim_(fh) == ftr_success) {
+        task->fn(task->arg, (uint8_t*)fh + fh->value_offs);
+        ftr_complete_(fh);
+    }
+    ftr_delete_(fh); // Drop the executor's reference
+}
+
+static int ftr_worker_main_(void* arg) {
+    struct ftr_worker* w = arg;
+    struct ftr_executor* exec = w->exec;
+    ftr_current_worker_ = w;
+#if defined(__linux__)
+    if (exec->node >= 0) {
+        // Fails outside the process's allowed CPUs, the worker then isn't pinned.
+        syscall(SYS_sched_setaffinity, 0, sizeof(exec->cpus), exec->cpus);
+    }
+#endif
+
+    for (;;) {
+        struct ftr_task task;
+        bool found = ftr_worker_pop_(w, &task, false);
+        for (size_t i = 1; !found && i < exec->nworkers; i++) {
+            found = ftr_worker_pop_(&exec->workers[(w->index + i) % exec->nworkers], &task, true);
+        }
+        if (found) {
+            atomic_fetch_sub(&exec->pending, 1);
+            ftr_task_run_(&task);
+            continue;
+        }
+
+        // Out of tasks: produce a deferred future ahead of its first reader.
+        mtx_lock(&exec->mtx);
+        struct ftr_deferred_* d = exec->deferred_head;
+        if (d && !atomic_load(&exec->pending) && !atomic_load(&exec->stopping)) {
+            exec->deferred_head = d->next;
+            if (!exec->deferred_head) {
+                exec->deferred_tail = NULL;
+            }
+            mtx_unlock(&exec->mtx);
+            struct ftr_header* fh = (struct ftr_header*)d->future;
+            ftr_deferred_run_(fh);
+            ftr_delete_(fh);
+            continue;
+        }
+
+        atomic_fetch_add(&exec->nidle, 1);
+        while (!atomic_load(&exec->pending) && !atomic_load(&exec->stopping) && !exec->deferred_head) {
+            cnd_wait(&exec->cvar, &exec->mtx);
+        }
+        atomic_fetch_sub(&exec->nidle, 1);
+        mtx_unlock(&exec->mtx);
+
+        // Queued tasks are drained before the workers exit.
+        if (atomic_load(&exec->stopping) && !atomic_load(&exec->pending)) {
+            break;
+        }
+    }
+
+    ftr_current_worker_ = NULL;
+    return 0;
+}
+
+struct ftr_executor* ftr_executor_create(size_t nthreads) {
+    return ftr_executor_create_on(nthreads, -1);
+}
+
+struct ftr_executor* ftr_executor_create_on(size_t nthreads, int node) {
+    if (node < -1 || node >= ftr_numa_nodes()) {
+        return NULL;
+    }
+    struct ftr_executor* exec = calloc(1, sizeof(struct ftr_executor));
+    if (!exec) {
+        return NULL;
+    }
+    exec->node = node;
+    if (node >= 0) {
+        size_t ncpus = ftr_numa_cpus_(node, exec->cpus, sizeof(exec->cpus) / sizeof(exec->cpus[0]));
+        if (!ncpus) {
+            free(exec); // Memory-only or offline node
+            return NULL;
+        }
+        nthreads = nthreads ? nthreads : ncpus;
+    }
+    if (!nthreads) {
+        nthreads = 1;
+    }
+
+    exec->workers = calloc(nthreads, sizeof(struct ftr_worker));
+    bool mtx_ok = exec->workers && mtx_init(&exec->mtx, mtx_plain) == thrd_success;
+    if (!mtx_ok || cnd_init(&exec->cvar) != thrd_success) {
+        if (mtx_ok) {
+            mtx_destroy(&exec->mtx);
+        }
+        free(exec->workers);
+        free(exec);
+        return NULL;
+    }
+    atomic_init(&exec->pending, 0);
+    atomic_init(&exec->nidle, 0);
+    atomic_init(&exec->next, 0);
+    atomic_init(&exec->stopping, false);
+
+    for (size_t i = 0; i < nthreads; i++) {
+        struct ftr_worker* w = &exec->workers[i];
+        w->exec = exec;
+        w->index = i;
+        if (mtx_init(&w->mtx, mtx_plain)) {
+            break;
+        }
+        exec->nworkers++;
+    }
+    size_t nstarted = 0;
+    while (nstarted < exec->nworkers && thrd_create(&exec->workers[nstarted].thread, ftr_worker_main_, &exec->workers[nstarted]) == thrd_success) {
+        nstarted++;
+    }
+    if (nstarted < nthreads) {
+        // Stop whatever was started, the workers that didn't start are torn down too.
+        atomic_store(&exec->stopping, true);
+        mtx_lock(&exec->mtx);
+        cnd_broadcast(&exec->cvar);
+        mtx_unlock(&exec->mtx);
+        for (size_t i = 0; i < nstarted; i++) {
+            thrd_join(exec->workers[i].thread, NULL);
+        }
+        for (size_t i = 0; i < exec->nworkers; i++) {
+            mtx_destroy(&exec->workers[i].mtx);
+        }
+        cnd_destroy(&exec->cvar);
+        mtx_destroy(&exec->mtx);
+        free(exec->workers);
+        free(exec);
+        return NULL;
+    }
+    return exec;
+}
+
+void ftr_executor_destroy(struct ftr_executor* exec) {
+    mtx_lock(&exec->mtx);
+    atomic_store(&exec->stopping, true);
+    cnd_broadcast(&exec->cvar);
+    mtx_unlock(&exec->mtx);
+
+    for (size_t i = 0; i < exec->nworkers; i++) {
+        thrd_join(exec->workers[i].thread, NULL);
+    }
+    for (size_t i = 0; i < exec->nworkers; i++) {
+        mtx_destroy(&exec->workers[i].mtx);
+        free(exec->workers[i].tasks);
+    }
+    // Deferred futures nobody got to stay deferred, their readers still run them.
+    while (exec->deferred_head) {
+        struct ftr_deferred_* d = exec->deferred_head;
+        exec->deferred_head = d->next;
+        ftr_delete_((struct ftr_header*)d->future);
+    }
+    cnd_destroy(&exec->cvar);
+    mtx_destroy(&exec->mtx);
+    free(exec->workers);
+    free(exec);
+}
+
+static int ftr_executor_push_(struct ftr_executor* exec, struct ftr_task task) {
+    struct ftr_worker* w = ftr_current_worker_;
+    if (!w || w->exec != exec) {
+        w = &exec->workers[atomic_fetch_add_explicit(&exec->next, 1, memory_order_relaxed) % exec->nworkers];
+    }
+    // Counted before it's published, so a worker popping it right away can't wrap pending.
+    // Pairs with the idle check in ftr_worker_main_, which is done under exec->mtx.
+    atomic_fetch_add(&exec->pending, 1);
+    int err = ftr_worker_push_(w, task);
+    if (err) {
+        atomic_fetch_sub(&exec->pending, 1);
+        return err;
+    }
+
+    if (atomic_load(&exec->nidle)) {
+        mtx_lock(&exec->mtx);
+        cnd_signal(&exec->cvar);
+        mtx_unlock(&exec->mtx);
+    }
+    return ftr_success;
+}
+
+int ftr_executor_submit(struct ftr_executor* exec, ftr_task_fn fn, void* arg) {
+    return ftr_executor_push_(exec, (struct ftr_task){ fn, arg, NULL });
+}
+
+struct ftr_header* ftr_async_(struct ftr_executor* exec, size_t wholesize, size_t vsize, size_t value_offs, ftr_task_fn fn, void* arg) {
+    struct ftr_header* fh = ftr_new_(wholesize, vsize, value_offs, 0);
+    if (!fh) {
+        return NULL;
+    }
+
+    // One reference for the caller, one for the task, so either side can finish first.
+    ftr_ref_(fh);
+    if (ftr_executor_push_(exec, (struct ftr_task){ fn, arg, fh })) {
+        ftr_delete_(fh);
+        ftr_delete_(fh);
+        return NULL;
+    }
+    return fh;
+}
+
+struct ftr_header* ftr_deferred_(struct ftr_executor* exec, size_t wholesize, size_t vsize, size_t value_offs, ftr_task_fn fn, void* arg) {
+    size_t size = offsetof(struct ftr_deferred_, future) + wholesize;
+    struct ftr_deferred_* d = aligned_alloc(ftr_align_, (size + ftr_align_ - 1) / ftr_align_ * ftr_align_);
+    if (!d) {
+        return NULL;
+    }
+    memset(d, 0, size);
+    d->fn = fn;
+    d->arg = arg;
+
+    struct ftr_header* fh = (struct ftr_header*)d->future;
+    int err = ftr_init_(fh, vsize, value_offs, ftr_flag_deferred);
+    if (err) {
+        fprintf(stderr, "error initializing future: %s", ftr_errorstr(err));
+        free(d);
+        return NULL;
+    }
+    if (!exec) {
+        return fh;
+    }
+
+    // The idle queue holds a reference until a worker takes it off.
+    ftr_ref_(fh);
+    mtx_lock(&exec->mtx);
+    if (exec->deferred_tail) {
+        exec->deferred_tail->next = d;
+    } else {
+        exec->deferred_head = d;
+    }
+    exec->deferred_tail = d;
+    if (atomic_load(&exec->nidle)) {
+        cnd_signal(&exec->cvar);
+    }
+    mtx_unlock(&exec->mtx);
+    return fh;
+}
+
+// Marks the continuation stack of a completed future, nothing can be pushed after it.
+static struct ftr_continuation ftr_continuations_done_;
+
+static void ftr_continuation_call_(struct ftr_continuation* c) {
+    ftr_then_fn fn = c->fn;
+    void* userdata = c->userdata;
+    struct ftr_header* fh = c->future;
+    bool skip = c->cancel_only && !ftr_is_cancelled(fh);
+    if (c->owned) {
+        free(c);
+    }
+    if (!skip) {
+        fn(userdata, fh);
+    }
+    ftr_delete_(fh); // Drop the reference taken by ftr_then_node_
+}
+
+static void ftr_continuation_task_(void* arg, void* value) {
+    (void)value;
+    ftr_continuation_call_(arg);
+}
+
+static void ftr_continuation_dispatch_(struct ftr_continuation* c) {
+    if (c->exec && ftr_executor_submit(c->exec, ftr_continuation_task_, c) == ftr_success) {
+        return;
+    }
+    ftr_continuation_call_(c);
+}
+
+static void ftr_run_continuations_(struct ftr_header* fh) {
+    struct ftr_continuation* list = atomic_exchange_explicit(&fh->continuations, &ftr_continuations_done_, memory_order_acq_rel);
+    if (list == &ftr_continuations_done_) {
+        return; // Already ran, the sentinel isn't a node
+    }
+
+    // Run them in registration order.
+    struct ftr_continuation* ordered = NULL;
+    while (list) {
+        struct ftr_continuation* next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+    while (ordered) {
+        struct ftr_continuation* next = ordered->next;
+        ftr_continuation_dispatch_(ordered);
+        ordered = next;
+    }
+}
+
+int ftr_then_node_(struct ftr_header* fh, struct ftr_continuation* node) {
+    if (fh->flags & ftr_flag_pshared) {
+        return ftr_invalid; // The completing process couldn't call it
+    }
+    node->future = fh;
+    ftr_ref_(fh);
+
+    struct ftr_continuation* head = atomic_load_explicit(&fh->continuations, memory_order_acquire);
+    do {
+        if (head == &ftr_continuations_done_) {
+            ftr_continuation_dispatch_(node);
+            return ftr_success;
+        }
+        node->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&fh->continuations, &head, node,
+                                                    memory_order_release, memory_order_acquire));
+    return ftr_success;
+}
+
+int ftr_then_(struct ftr_header* fh, struct ftr_executor* exec, ftr_then_fn fn, void* userdata) {
+    struct ftr_continuation* c = malloc(sizeof(struct ftr_continuation));
+    if (!c) {
+        return ftr_nomem;
+    }
+    *c = (struct ftr_continuation){ .fn = fn, .userdata = userdata, .exec = exec, .owned = true };
+    int err = ftr_then_node_(fh, c);
+    if (err) {
+        free(c);
+    }
+    return err;
+}
+
+int ftr_on_cancel_(struct ftr_header* fh, ftr_then_fn fn, void* userdata) {
+    struct ftr_continuation* c = malloc(sizeof(struct ftr_continuation));
+    if (!c) {
+        return ftr_nomem;
+    }
+    *c = (struct ftr_continuation){ .fn = fn, .userdata = userdata, .owned = true, .cancel_only = true };
+    int err = ftr_then_node_(fh, c);
+    if (err) {
+        free(c);
+    }
+    return err;
+}
+
+#define ftr_wheel_bits0 8
+#define ftr_wheel_bits 6
+#define ftr_wheel_levels 4
+#define ftr_wheel_slots0 (1u << ftr_wheel_bits0)
+#define ftr_wheel_slots (1u << ftr_wheel_bits)
+#define ftr_wheel_span_(level) (UINT64_C(1) << (ftr_wheel_bits0 + (level) * ftr_wheel_bits))
+#define ftr_wheel_max ftr_wheel_span_(ftr_wheel_levels - 1)
+#define ftr_wheel_batch 64 // Futures failed per round without holding the wheel lock
+
+struct ftr_timer_ {
+    struct ftr_continuation node; // Disarms the timer (if still armed) and frees it once the future is done
+    struct ftr_header* future;
+    struct ftr_timer_* next;
+    struct ftr_timer_** pprev; // The link pointing at this timer, NULL once it's no longer armed
+    uint64_t expires; // In ticks
+};
+
+// Level 0 has a slot per tick, each level above has slots covering a whole turn of the one below.
+struct ftr_wheel_ {
+    mtx_t mtx;
+    cnd_t cvar;
+    uint64_t tick; // Next tick to process, everything before it has expired
+    uint64_t wake; // Tick the wheel thread sleeps until, UINT64_MAX when idle
+    size_t count; // Armed timers, in a slot or in due
+    struct ftr_timer_* due; // Expired, waiting to be failed by the wheel thread
+    struct ftr_timer_* slots0[ftr_wheel_slots0];
+    struct ftr_timer_* slots[ftr_wheel_levels - 1][ftr_wheel_slots];
+};
+
+static struct ftr_wheel_ ftr_wheel_;
+
+static once_flag ftr_wheel_once_ = ONCE_FLAG_INIT;
+
+static bool ftr_wheel_running_;
+
+static uint64_t ftr_wheel_now_(void) {
+    return (uint64_t)ftr_now_ns_() / 1000000;
+}
+
+static void ftr_wheel_link_(struct ftr_timer_** head, struct ftr_timer_* t) {
+    t->next = *head;
+    if (t->next) {
+        t->next->pprev = &t->next;
+    }
+    t->pprev = head;
+    *head = t;
+}
+
+static void ftr_wheel_unlink_(struct ftr_timer_* t) {
+    *t->pprev = t->next;
+    if (t->next) {
+        t->next->pprev = t->pprev;
+    }
+    t->pprev = NULL;
+}
+
+// Files the timer by how far it is from the wheel's tick. Called with the wheel locked.
+static void ftr_wheel_insert_(struct ftr_wheel_* w, struct ftr_timer_* t) {
+    uint64_t expires = t->expires < w->tick ? w->tick : t->expires;
+    uint64_t delta = expires - w->tick;
+    if (delta < ftr_wheel_slots0) {
+        ftr_wheel_link_(&w->slots0[expires & (ftr_wheel_slots0 - 1)], t);
+        return;
+    }
+
+    // Beyond the top level it waits in the furthest slot and is filed again from there.
+    if (delta >= ftr_wheel_max) {
+        delta = ftr_wheel_max - 1;
+        expires = w->tick + delta;
+    }
+    size_t level = 0;
+    while (delta >= ftr_wheel_span_(level + 1)) {
+        level++;
+    }
+    size_t index = (size_t)(expires >> (ftr_wheel_bits0 + level * ftr_wheel_bits)) & (ftr_wheel_slots - 1);
+    ftr_wheel_link_(&w->slots[level][index], t);
+}
+
+// Processes w->tick: refiles higher level slots that start here, then moves its level 0 slot to due.
+static void ftr_wheel_advance_(struct ftr_wheel_* w) {
+    size_t index0 = (size_t)(w->tick & (ftr_wheel_slots0 - 1));
+    for (size_t level = 0; !index0 && level < ftr_wheel_levels - 1; level++) {
+        size_t index = (size_t)(w->tick >> (ftr_wheel_bits0 + level * ftr_wheel_bits)) & (ftr_wheel_slots - 1);
+        struct ftr_timer_* t = w->slots[level][index];
+        w->slots[level][index] = NULL;
+        while (t) {
+            struct ftr_timer_* next = t->next;
+            ftr_wheel_insert_(w, t);
+            t = next;
+        }
+        if (index) {
+            break; // The next level only turns when this one wraps
+        }
+    }
+
+    struct ftr_timer_* t = w->slots0[index0];
+    w->slots0[index0] = NULL;
+    while (t) {
+        struct ftr_timer_* next = t->next;
+        ftr_wheel_link_(&w->due, t);
+        t = next;
+    }
+    w->tick++;
+}
+
+// The next tick with work: a non-empty level 0 slot, or the next time the higher levels turn.
+static uint64_t ftr_wheel_next_(struct ftr_wheel_* w) {
+    uint64_t turn = (w->tick + ftr_wheel_slots0 - 1) & ~(uint64_t)(ftr_wheel_slots0 - 1);
+    for (uint64_t tick = w->tick; tick < turn; tick++) {
+        if (w->slots0[tick & (ftr_wheel_slots0 - 1)]) {
+            return tick;
+        }
+    }
+    return turn;
+}
+
+static int ftr_wheel_run_(void* arg) {
+    struct ftr_wheel_* w = arg;
+    struct ftr_header* due[ftr_wheel_batch];
+
+    mtx_lock(&w->mtx);
+    for (;;) {
+        uint64_t now = ftr_wheel_now_();
+        while (w->tick <= now) {
+            ftr_wheel_advance_(w);
+        }
+
+        // The references keep the futures alive once their timers (and the lock) are let go.
+        size_t n = 0;
+        while (w->due && n < ftr_wheel_batch) {
+            struct ftr_timer_* t = w->due;
+            ftr_wheel_unlink_(t);
+            w->count--;
+            ftr_ref_(t->future);
+            due[n++] = t->future;
+        }
+        if (n) {
+            mtx_unlock(&w->mtx);
+            for (size_t i = 0; i < n; i++) {
+                // Only if nobody claimed it yet, a producer halfway through publishing wins.
+                if (ftr_claim_(due[i]) == ftr_success) {
+                    ftr_fail_claimed_(due[i], ftr_timedout);
+                }
+                ftr_delete_(due[i]);
+            }
+            mtx_lock(&w->mtx);
+            continue;
+        }
+
+        if (!w->count) {
+            w->wake = UINT64_MAX;
+            cnd_wait(&w->cvar, &w->mtx);
+            continue;
+        }
+
+        w->wake = ftr_wheel_next_(w);
+        int64_t remaining = (int64_t)w->wake * 1000000 - ftr_now_ns_();
+        if (remaining > 0) {
+            struct timespec utc;
+            timespec_get(&utc, TIME_UTC);
+            ftr_timespec_add_ns_(&utc, remaining);
+            cnd_timedwait(&w->cvar, &w->mtx, &utc);
+        }
+    }
+    return 0;
+}
+
+static void ftr_wheel_init_(void) {
+    struct ftr_wheel_* w = &ftr_wheel_;
+    if (mtx_init(&w->mtx, mtx_plain) != thrd_success) {
+        return;
+    }
+    if (cnd_init(&w->cvar) != thrd_success) {
+        mtx_destroy(&w->mtx);
+        return;
+    }
+    w->tick = ftr_wheel_now_();
+    w->wake = UINT64_MAX;
+
+    thrd_t thread;
+    if (thrd_create(&thread, ftr_wheel_run_, w) != thrd_success) {
+        cnd_destroy(&w->cvar);
+        mtx_destroy(&w->mtx);
+        return;
+    }
+    thrd_detach(thread);
+    ftr_wheel_running_ = true;
+}
+
+static void ftr_timer_done_(void* userdata, void* future) {
+    (void)future;
+    struct ftr_timer_* t = userdata;
+    struct ftr_wheel_* w = &ftr_wheel_;
+    mtx_lock(&w->mtx);
+    if (t->pprev) {
+        ftr_wheel_unlink_(t);
+        w->count--;
+    }
+    mtx_unlock(&w->mtx);
+    free(t);
+}
+
+int ftr_timeout_(struct ftr_header* fh, int32_t timeout_ms) {
+    if (timeout_ms < 0 || (fh->flags & ftr_flag_pshared)) {
+        return ftr_invalid;
+    }
+    call_once(&ftr_wheel_once_, ftr_wheel_init_);
+    if (!ftr_wheel_running_) {
+        return ftr_error;
+    }
+
+    struct ftr_timer_* t = calloc(1, sizeof(struct ftr_timer_));
+    if (!t) {
+        return ftr_nomem;
+    }
+    t->node.fn = ftr_timer_done_;
+    t->node.userdata = t;
+    t->future = fh;
+
+    struct ftr_wheel_* w = &ftr_wheel_;
+    mtx_lock(&w->mtx);
+    uint64_t now = ftr_wheel_now_();
+    if (!w->count) {
+        w->tick = now; // Idle, skip the ticks it slept through
+    }
+    t->expires = now + (uint64_t)timeout_ms + 1; // Ticks are truncated, this never fires early
+    ftr_wheel_insert_(w, t);
+    w->count++;
+    if (t->expires < w->wake) {
+        cnd_signal(&w->cvar);
+    }
+    mtx_unlock(&w->mtx);
+
+    // Registered last: if the future is already done (or the timer fired meanwhile) it disarms right away.
+    return ftr_then_node_(fh, &t->node);
+}
+
+struct ftr_when_;
+
+struct ftr_when_node_ {
+    struct ftr_continuation node;
+    struct ftr_when_* when;
+};
+
+struct ftr_when_ {
+    ftr_when_future_t future; // Must be first, ftr_delete_ frees the whole block
+    atomic_size_t remaining;
+    bool any;
+    struct ftr_when_node_ nodes[];
+};
+
+static void ftr_when_then_(void* userdata, void* future) {
+    struct ftr_when_node_* wn = userdata;
+    struct ftr_when_* w = wn->when;
+    size_t index = (size_t)(wn - w->nodes);
+    int err = ftr_done_(future, atomic_load_explicit(&((struct ftr_header*)future)->state, memory_order_acquire));
+
+    if (!w->any && err) {
+        ftr_fail_(&w->future.header, err); // Short-circuit on the first failed input
+    } else if (w->any) {
+        if (ftr_claim_(&w->future.header) == ftr_success) {
+            w->future.value = index;
+            ftr_complete_(&w->future.header);
+        }
+    } else if (atomic_fetch_sub_explicit(&w->remaining, 1, memory_order_acq_rel) == 1) {
+        if (ftr_claim_(&w->future.header) == ftr_success) {
+            ftr_complete_(&w->future.header);
+        }
+    }
+    ftr_delete_(&w->future.header); // Each input holds a reference on the block
+}
+
+struct ftr_header* ftr_when_(struct ftr_header** futures, size_t n, bool any) {
+    if (any && !n) {
+        return NULL;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (futures[i]->flags & ftr_flag_pshared) {
+            return NULL;
+        }
+    }
+
+    // Aligned like ftr_new_, ftr_when_future_t may be over-aligned (ftr_cache_align).
+    size_t size = ftr_array_stride(sizeof(struct ftr_when_) + n * sizeof(struct ftr_when_node_));
+    struct ftr_when_* w = aligned_alloc(ftr_cacheline, size);
+    if (!w) {
+        return NULL;
+    }
+    memset(w, 0, size);
+    if (ftr_init(ftr_when_future_t, &w->future)) {
+        ftr_destroy(&w->future);
+        free(w);
+        return NULL;
+    }
+    atomic_init(&w->remaining, n);
+    w->any = any;
+    w->future.value = n;
+    if (!n) {
+        ftr_complete(&w->future, 0);
+        return &w->future.header;
+    }
+
+    atomic_fetch_add_explicit(&w->future.header.refs, n, memory_order_relaxed);
+    for (size_t i = 0; i < n; i++) {
+        struct ftr_when_node_* wn = &w->nodes[i];
+        wn->when = w;
+        wn->node.fn = ftr_when_then_;
+        wn->node.userdata = wn;
+        ftr_then_node_(futures[i], &wn->node);
+    }
+    return &w->future.header;
+}
+
+int ftr_wait_all_(struct ftr_header** futures, size_t n, int32_t timeout_ms) {
+    for (size_t j = 0; j < n; j++) {
+        if (futures[j]->flags & ftr_flag_deferred) {
+            ftr_deferred_run_(futures[j]);
+        }
+    }
+
+    // Only set up a waiter if something is still pending, and nothing failed already.
+    size_t i = n;
+    for (size_t j = 0; j < n; j++) {
+        uint32_t s = atomic_load_explicit(&futures[j]->state, memory_order_acquire);
+        if ((s & ftr_state_mask) > ftr_consumed) {
+            return ftr_done_(futures[j], s);
+        }
+        if ((s & ftr_state_mask) < ftr_ready && i == n) {
+            i = j;
+        }
+    }
+    if (i == n) {
+        return ftr_success;
+    }
+    if (timeout_ms == 0) {
+        return ftr_timedout;
+    }
+
+    struct ftr_header* w = ftr_when_(futures + i, n - i, false);
+    if (!w) {
+        return ftr_nomem;
+    }
+    int err = ftr_wait_(w, timeout_ms);
+    ftr_delete_(w);
+    return err;
+}
+
+int ftr_wait_any_(struct ftr_header** futures, size_t n, int32_t timeout_ms, size_t* index) {
+    if (!n) {
+        return ftr_invalid;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if ((atomic_load_explicit(&futures[i]->state, memory_order_acquire) & ftr_state_mask) >= ftr_ready) {
+            *index = i;
+            return ftr_success;
+        }
+    }
+    // Producing one deferred input is enough.
+    for (size_t i = 0; i < n; i++) {
+        if ((futures[i]->flags & ftr_flag_deferred) && (ftr_demand_(futures[i]) & ftr_state_mask) >= ftr_ready) {
+            *index = i;
+            return ftr_success;
+        }
+    }
+    if (timeout_ms == 0) {
+        return ftr_timedout;
+    }
+
+    ftr_when_future_t* w = (ftr_when_future_t*)ftr_when_(futures, n, true);
+    if (!w) {
+        return ftr_nomem;
+    }
+    int err = ftr_wait(w, timeout_ms);
+    if (err == ftr_success) {
+        *index = w->value;
+    }
+    ftr_delete(w);
+    return err;
+}
+
+// Handles are structs with a single pointer to the state, copied with memcpy so any FT works.
+static struct ftr_header* ftr_handle_take_(void* handle) {
+    struct ftr_header* fh = NULL;
+    memcpy(&fh, handle, sizeof(fh));
+    memset(handle, 0, sizeof(fh));
+    return fh;
+}
+
+int ftr_promise_settle_(void* promise, int err) {
+    struct ftr_header* fh = ftr_handle_take_(promise);
+    if (fh) {
+        ftr_delete_(fh);
+    }
+    return err;
+}
+
+void ftr_promise_release_(void* promise) {
+    struct ftr_header* fh = ftr_handle_take_(promise);
+    if (fh) {
+        ftr_fail_(fh, ftr_broken); // No-op if it was completed through another path
+        ftr_delete_(fh);
+    }
+}
+
+void ftr_future_release_(void* future) {
+    struct ftr_header* fh = ftr_handle_take_(future);
+    if (fh) {
+        ftr_cancel_(fh); // No-op unless still pending
+        ftr_delete_(fh);
+    }
+}
+
+struct ftr_channel_cell_ {
+    atomic_size_t seq; // pos when free for the send at pos, pos + 1 once it holds its value
+    uint8_t value[];
+};
+
+static inline struct ftr_channel_cell_* ftr_channel_cell_(struct ftr_channel* ch, size_t pos) {
+    return (struct ftr_channel_cell_*)(ch->cells + (pos & ch->mask) * ch->stride);
+}
+
+struct ftr_channel* ftr_channel_new_(size_t wholesize, size_t vsize, size_t capacity) {
+    if (!capacity || capacity > SIZE_MAX / 2) {
+        return NULL;
+    }
+    size_t n = 1;
+    while (n < capacity) { n <<= 1; }
+
+    size_t stride = (sizeof(struct ftr_channel_cell_) + vsize + sizeof(size_t) - 1) / sizeof(size_t) * sizeof(size_t);
+    if (n > SIZE_MAX / stride) {
+        return NULL;
+    }
+
+    struct ftr_channel* ch = aligned_alloc(ftr_cacheline, ftr_array_stride(wholesize));
+    if (!ch) {
+        return NULL;
+    }
+    memset(ch, 0, wholesize);
+    ch->cells = aligned_alloc(ftr_cacheline, ftr_array_stride(n * stride));
+    if (!ch->cells) {
+        free(ch);
+        return NULL;
+    }
+    ch->mask = n - 1;
+    ch->value_size = vsize;
+    ch->stride = stride;
+    atomic_init(&ch->tail, 0);
+    atomic_init(&ch->head, 0);
+    for (size_t i = 0; i < n; i++) {
+        atomic_init(&ftr_channel_cell_(ch, i)->seq, i);
+    }
+
+    if (ftr_init_header_(&ch->not_empty, 0, 0, 0) || ftr_init_header_(&ch->not_full, 0, 0, 0)) {
+        free(ch->cells);
+        free(ch);
+        return NULL;
+    }
+    return ch;
+}
+
+void ftr_channel_delete_(struct ftr_channel* ch) {
+    ftr_destroy_header_(&ch->not_empty);
+    ftr_destroy_header_(&ch->not_full);
+    free(ch->cells);
+    free(ch);
+}
+
+// Claims up to n consecutive cells at `*posp` whose sequence is `pos + ready` (ready is 0
+// for free cells, 1 for full ones), with a single CAS. Returns how many were claimed.
+static size_t ftr_channel_claim_(struct ftr_channel* ch, ftr_atomic(size_t)* posp, size_t ready, size_t n, size_t* first) {
+    size_t pos = atomic_load_explicit(posp, memory_order_relaxed);
+    for (;;) {
+        size_t k = 0;
+        intptr_t dif = 0;
+        while (k < n) {
+            size_t seq = atomic_load_explicit(&ftr_channel_cell_(ch, pos + k)->seq, memory_order_acquire);
+            dif = (intptr_t)(seq - (pos + k + ready));
+            if (dif != 0) { break; }
+            k++;
+        }
+        if (k == 0) {
+            if (dif < 0) { return 0; } // Full (or empty)
+            pos = atomic_load_explicit(posp, memory_order_relaxed); // Another thread moved past pos
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(posp, &pos, pos + k, memory_order_relaxed, memory_order_relaxed)) {
+            *first = pos;
+            return k;
+        }
+    }
+}
+
+static size_t ftr_channel_push_(struct ftr_channel* ch, uint8_t* src, size_t n) {
+    size_t pos;
+    size_t k = ftr_channel_claim_(ch, &ch->tail, 0, n, &pos);
+    for (size_t i = 0; i < k; i++) {
+        struct ftr_channel_cell_* cell = ftr_channel_cell_(ch, pos + i);
+        memcpy(cell->value, src + i * ch->value_size, ch->value_size);
+        atomic_store_explicit(&cell->seq, pos + i + 1, memory_order_release);
+    }
+    return k;
+}
+
+static size_t ftr_channel_pop_(struct ftr_channel* ch, uint8_t* dest, size_t n) {
+    size_t pos;
+    size_t k = ftr_channel_claim_(ch, &ch->head, 1, n, &pos);
+    for (size_t i = 0; i < k; i++) {
+        struct ftr_channel_cell_* cell = ftr_channel_cell_(ch, pos + i);
+        memcpy(dest + i * ch->value_size, cell->value, ch->value_size);
+        atomic_store_explicit(&cell->seq, pos + i + ch->mask + 1, memory_order_release);
+    }
+    return k;
+}
+
+// Runs op until it transfers something, waiting on `blocked` in between, then signals `other`.
+static int ftr_channel_xfer_(struct ftr_channel* ch, int32_t timeout_ms, uint8_t* buf, size_t n, size_t* count,
+                             size_t (*op)(struct ftr_channel*, uint8_t*, size_t),
+                             struct ftr_header* blocked, struct ftr_header* other) {
+    size_t k = 0;
+    if (count) { *count = 0; }
+    if (!n) { return ftr_success; }
+
+    k = op(ch, buf, n);
+    if (!k && timeout_ms != 0) {
+        uint32_t spins = atomic_load_explicit(&ftr_spins_, memory_order_relaxed);
+        for (uint32_t i = 0; i < spins && !k; i++) {
+            ftr_cpu_relax_();
+            k = op(ch, buf, n);
+        }
+        uint32_t yields = atomic_load_explicit(&ftr_yields_, memory_order_relaxed);
+        for (uint32_t i = 0; i < yields && !k; i++) {
+            thrd_yield();
+            k = op(ch, buf, n);
+        }
+
+        struct timespec deadline;
+        ftr_deadline_in(&deadline, (int64_t)timeout_ms * 1000);
+        while (!k) {
+            // Always an RMW, even if the flag is already set by another waiter, so it's
+            // ordered against the signaler's fence before we re-check.
+            uint32_t seen = atomic_load_explicit(&blocked->state, memory_order_relaxed);
+            if (!atomic_compare_exchange_weak(&blocked->state, &seen, seen | ftr_state_waiters)) {
+                continue;
+            }
+            seen |= ftr_state_waiters;
+            atomic_thread_fence(memory_order_seq_cst);
+            if ((k = op(ch, buf, n))) {
+                break;
+            }
+            int err = ftr_event_wait_(blocked, seen, &deadline);
+            k = op(ch, buf, n);
+            if (!k && err) {
+                return err;
+            }
+        }
+    }
+    if (!k) {
+        return ftr_timedout;
+    }
+
+    ftr_event_signal_(other);
+    if (count) { *count = k; }
+    return ftr_success;
+}
+
+int ftr_channel_send_(struct ftr_channel* ch, int32_t timeout_ms, const void* src, size_t src_size, size_t n, size_t* sent, size_t check) {
+    (void)check;
+
+    if (src_size != ch->value_size) {
+        return ftr_destsize;
+    }
+    return ftr_channel_xfer_(ch, timeout_ms, (uint8_t*)src, n, sent, ftr_channel_push_, &ch->not_full, &ch->not_empty);
+}
+
+int ftr_channel_recv_(struct ftr_channel* ch, int32_t timeout_ms, void* dest, size_t dest_size, size_t n, size_t* received, size_t check) {
+    (void)check;
+
+    if (dest_size != ch->value_size) {
+        return ftr_destsize;
+    }
+    return ftr_channel_xfer_(ch, timeout_ms, dest, n, received, ftr_channel_pop_, &ch->not_empty, &ch->not_full);
+}
+
+struct ftr_cache_entry_ {
+    struct ftr_continuation node; // Stamps completed_ns when the future is done
+    struct ftr_cache_entry_* next; // Bucket chain
+    struct ftr_cache_entry_* newer; // LRU list, most recently used at the shard's newest
+    struct ftr_cache_entry_* older;
+    struct ftr_header* future;
+    atomic_int_fast64_t completed_ns; // 0 while pending
+    atomic_uint refs; // The shard's and the continuation's
+    uint64_t hash;
+    char key[];
+};
+
+struct ftr_cache_shard_ {
+    ftr_alignas_(ftr_cacheline) mtx_t mtx;
+    struct ftr_cache_entry_** buckets;
+    size_t mask; // Number of buckets - 1
+    size_t count;
+    struct ftr_cache_entry_* newest;
+    struct ftr_cache_entry_* oldest;
+};
+
+struct ftr_cache {
+    size_t wholesize;
+    size_t value_size;
+    size_t value_offs;
+    size_t capacity; // Per shard
+    int64_t ttl_ns;
+    size_t mask; // Number of shards - 1
+    struct ftr_cache_shard_* shards;
+};
+
+static size_t ftr_pow2_ceil_(size_t n) {
+    size_t p = 1;
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+// FNV-1a, the low bits pick the shard and the high ones the bucket.
+static uint64_t ftr_cache_hash_(const char* key) {
+    uint64_t h = UINT64_C(14695981039346656037);
+    for (const unsigned char* p = (const unsigned char*)key; *p; p++) {
+        h = (h ^ *p) * UINT64_C(1099511628211);
+    }
+    return h;
+}
+
+static void ftr_cache_entry_unref_(struct ftr_cache_entry_* e) {
+    if (atomic_fetch_sub_explicit(&e->refs, 1, memory_order_acq_rel) == 1) {
+        free(e);
+    }
+}
+
+static void ftr_cache_entry_done_(void* userdata, void* future) {
+    (void)future;
+    struct ftr_cache_entry_* e = userdata;
+    int64_t now = ftr_now_ns_();
+    atomic_store_explicit(&e->completed_ns, now ? now : 1, memory_order_release);
+    ftr_cache_entry_unref_(e);
+}
+
+static struct ftr_cache_entry_** ftr_cache_bucket_(struct ftr_cache_shard_* shard, uint64_t hash) {
+    return &shard->buckets[(hash >> 32) & shard->mask];
+}
+
+static void ftr_cache_lru_unlink_(struct ftr_cache_shard_* shard, struct ftr_cache_entry_* e) {
+    if (e->newer) { e->newer->older = e->older; } else { shard->newest = e->older; }
+    if (e->older) { e->older->newer = e->newer; } else { shard->oldest = e->newer; }
+    e->newer = e->older = NULL;
+}
+
+static void ftr_cache_lru_push_(struct ftr_cache_shard_* shard, struct ftr_cache_entry_* e) {
+    e->older = shard->newest;
+    e->newer = NULL;
+    if (shard->newest) { shard->newest->newer = e; } else { shard->oldest = e; }
+    shard->newest = e;
+}
+
+// Takes the entry out of the shard and drops the shard's references. Called with the shard locked.
+static void ftr_cache_evict_(struct ftr_cache_shard_* shard, struct ftr_cache_entry_* e) {
+    struct ftr_cache_entry_** link = ftr_cache_bucket_(shard, e->hash);
+    while (*link != e) {
+        link = &(*link)->next;
+    }
+    *link = e->next;
+    ftr_cache_lru_unlink_(shard, e);
+    shard->count--;
+    ftr_delete_(e->future);
+    ftr_cache_entry_unref_(e);
+}
+
+// Whether a caller can still be handed the entry's future.
+static bool ftr_cache_usable_(struct ftr_cache* cache, struct ftr_cache_entry_* e, int64_t now) {
+    uint32_t s = atomic_load_explicit(&e->future->state, memory_order_acquire) & ftr_state_mask;
+    if (s == ftr_pending || s == ftr_completing) {
+        return true;
+    }
+    if (s != ftr_ready) {
+        return false; // Failed or cancelled: let the next caller retry
+    }
+    int64_t completed = atomic_load_explicit(&e->completed_ns, memory_order_acquire);
+    return !completed || now - completed < cache->ttl_ns; // Not stamped yet means it just completed
+}
+
+// Tears down the first n shards and the cache itself.
+static void ftr_cache_free_(struct ftr_cache* cache, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        struct ftr_cache_shard_* shard = &cache->shards[i];
+        while (shard->oldest) {
+            ftr_cache_evict_(shard, shard->oldest);
+        }
+        free(shard->buckets);
+        mtx_destroy(&shard->mtx);
+    }
+    free(cache->shards);
+    free(cache);
+}
+
+struct ftr_cache* ftr_cache_create_(size_t wholesize, size_t vsize, size_t value_offs, size_t nshards, size_t capacity, int32_t ttl_ms) {
+    struct ftr_cache* cache = calloc(1, sizeof(struct ftr_cache));
+    if (!cache) {
+        return NULL;
+    }
+    size_t n = ftr_pow2_ceil_(nshards ? nshards : 1);
+    cache->wholesize = wholesize;
+    cache->value_size = vsize;
+    cache->value_offs = value_offs;
+    cache->capacity = capacity / n ? capacity / n : 1;
+    cache->ttl_ns = (int64_t)(ttl_ms > 0 ? ttl_ms : 0) * 1000000;
+    cache->mask = n - 1;
+
+    cache->shards = aligned_alloc(ftr_cacheline, n * sizeof(struct ftr_cache_shard_));
+    if (!cache->shards) {
+        free(cache);
+        return NULL;
+    }
+    memset(cache->shards, 0, n * sizeof(struct ftr_cache_shard_));
+    size_t nbuckets = ftr_pow2_ceil_(cache->capacity);
+    for (size_t i = 0; i < n; i++) {
+        struct ftr_cache_shard_* shard = &cache->shards[i];
+        shard->buckets = calloc(nbuckets, sizeof(struct ftr_cache_entry_*));
+        if (!shard->buckets || mtx_init(&shard->mtx, mtx_plain) != thrd_success) {
+            free(shard->buckets);
+            ftr_cache_free_(cache, i);
+            return NULL;
+        }
+        shard->mask = nbuckets - 1;
+    }
+    return cache;
+}
+
+void ftr_cache_destroy(struct ftr_cache* cache) {
+    ftr_cache_free_(cache, cache->mask + 1);
+}
+
+void* ftr_cache_get_or_start(struct ftr_cache* cache, const char* key, ftr_cache_fn fn, void* arg) {
+    uint64_t hash = ftr_cache_hash_(key);
+    struct ftr_cache_shard_* shard = &cache->shards[hash & cache->mask];
+    int64_t now = ftr_now_ns_();
+
+    mtx_lock(&shard->mtx);
+    struct ftr_cache_entry_* e = *ftr_cache_bucket_(shard, hash);
+    while (e && (e->hash != hash || strcmp(e->key, key))) {
+        e = e->next;
+    }
+    if (e && ftr_cache_usable_(cache, e, now)) {
+        ftr_cache_lru_unlink_(shard, e);
+        ftr_cache_lru_push_(shard, e);
+        ftr_ref_(e->future);
+        mtx_unlock(&shard->mtx);
+        return e->future;
+    }
+    if (e) {
+        ftr_cache_evict_(shard, e);
+    }
+
+    // Make room from the old end, skipping entries still in flight.
+    for (struct ftr_cache_entry_* old = shard->oldest; old && shard->count >= cache->capacity;) {
+        struct ftr_cache_entry_* newer = old->newer;
+        uint32_t s = atomic_load_explicit(&old->future->state, memory_order_acquire) & ftr_state_mask;
+        if (s != ftr_pending && s != ftr_completing) {
+            ftr_cache_evict_(shard, old);
+        }
+        old = newer;
+    }
+
+    size_t len = strlen(key);
+    e = calloc(1, sizeof(struct ftr_cache_entry_) + len + 1);
+    struct ftr_header* fh = e ? ftr_new_(cache->wholesize, cache->value_size, cache->value_offs, ftr_flag_shared) : NULL;
+    if (!fh) {
+        mtx_unlock(&shard->mtx);
+        free(e);
+        return NULL;
+    }
+    memcpy(e->key, key, len + 1);
+    e->hash = hash;
+    e->future = fh;
+    e->node.fn = ftr_cache_entry_done_;
+    e->node.userdata = e;
+    atomic_init(&e->completed_ns, 0);
+    atomic_init(&e->refs, 2);
+    e->next = *ftr_cache_bucket_(shard, hash);
+    *ftr_cache_bucket_(shard, hash) = e;
+    ftr_cache_lru_push_(shard, e);
+    shard->count++;
+    ftr_ref_(fh); // The caller's, the shard holds the one from ftr_new_
+    mtx_unlock(&shard->mtx);
+
+    ftr_then_node_(fh, &e->node);
+    fn(arg, key, fh);
+    return fh;
+}
+
+void ftr_cache_remove(struct ftr_cache* cache, const char* key) {
+    uint64_t hash = ftr_cache_hash_(key);
+    struct ftr_cache_shard_* shard = &cache->shards[hash & cache->mask];
+
+    mtx_lock(&shard->mtx);
+    struct ftr_cache_entry_* e = *ftr_cache_bucket_(shard, hash);
+    while (e && (e->hash != hash || strcmp(e->key, key))) {
+        e = e->next;
+    }
+    if (e) {
+        ftr_cache_evict_(shard, e);
+    }
+    mtx_unlock(&shard->mtx);
+}
+
+#ifndef _WIN32
+
+struct ftr_notify_node_ {
+    struct ftr_continuation node;
+    struct ftr_notifier* notifier;
+    struct ftr_notify_node_* next;
+    struct ftr_header* future;
+};
+
+static void ftr_notifier_signal_(struct ftr_notifier* n) {
+#if defined(__linux__)
+    uint64_t one = 1;
+    while (write(n->fd, &one, sizeof(one)) < 0 && errno == EINTR) {}
+#elif defined(ftr_has_kqueue_)
+    struct kevent kev;
+    EV_SET(&kev, 1, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    kevent(n->fd, &kev, 1, NULL, 0, NULL);
+#else
+    uint8_t one = 1;
+    while (write(n->wfd, &one, sizeof(one)) < 0 && errno == EINTR) {}
+#endif
+}
+
+// Resets the descriptor to not readable.
+static void ftr_notifier_reset_(struct ftr_notifier* n) {
+#if defined(__linux__)
+    uint64_t count;
+    while (read(n->fd, &count, sizeof(count)) < 0 && errno == EINTR) {}
+#elif defined(ftr_has_kqueue_)
+    struct kevent kev;
+    struct timespec zero = {0};
+    kevent(n->fd, NULL, 0, &kev, 1, &zero); // EV_CLEAR: consuming the event resets it
+#else
+    uint8_t buf[64];
+    while (read(n->fd, buf, sizeof(buf)) > 0) {}
+#endif
+}
+
+static void ftr_notifier_unref_(struct ftr_notifier* n) {
+    if (atomic_fetch_sub_explicit(&n->refs, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+    // Completions that saw the notifier open may have pushed after ftr_notifier_destroy
+    // drained it. They're all done now, release what they left.
+    struct ftr_notify_node_* lists[2] = { n->backlog, atomic_load_explicit(&n->ready, memory_order_acquire) };
+    for (int i = 0; i < 2; i++) {
+        while (lists[i]) {
+            struct ftr_notify_node_* next = lists[i]->next;
+            ftr_delete_(lists[i]->future);
+            free(lists[i]);
+            lists[i] = next;
+        }
+    }
+    close(n->fd);
+    if (n->wfd >= 0) {
+        close(n->wfd);
+    }
+    free(n);
+}
+
+struct ftr_notifier* ftr_notifier_create(void) {
+    struct ftr_notifier* n = calloc(1, sizeof(struct ftr_notifier));
+    if (!n) {
+        return NULL;
+    }
+    n->wfd = -1;
+#if defined(__linux__)
+    n->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#elif defined(ftr_has_kqueue_)
+    n->fd = kqueue();
+    if (n->fd >= 0) {
+        struct kevent kev;
+        EV_SET(&kev, 1, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+        if (kevent(n->fd, &kev, 1, NULL, 0, NULL) < 0) {
+            close(n->fd);
+            n->fd = -1;
+        }
+    }
+#else
+    int fds[2];
+    n->fd = -1;
+    if (pipe(fds) == 0) {
+        fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+        n->fd = fds[0];
+        n->wfd = fds[1];
+    }
+#endif
+    if (n->fd < 0) {
+        free(n);
+        return NULL;
+    }
+    atomic_init(&n->refs, 1);
+    atomic_init(&n->closed, false);
+    atomic_init(&n->ready, NULL);
+    return n;
+}
+
+int ftr_get_fd(struct ftr_notifier* n) {
+    return n->fd;
+}
+
+static void ftr_notify_then_(void* userdata, void* future) {
+    (void)future;
+    struct ftr_notify_node_* nn = userdata;
+    struct ftr_notifier* n = nn->notifier;
+
+    if (atomic_load_explicit(&n->closed, memory_order_acquire)) {
+        // Nobody will drain it anymore, drop the reference we were handed.
+        ftr_delete_(nn->future);
+        free(nn);
+        ftr_notifier_unref_(n);
+        return;
+    }
+
+    struct ftr_notify_node_* head = atomic_load_explicit(&n->ready, memory_order_relaxed);
+    do {
+        nn->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&n->ready, &head, nn, memory_order_release, memory_order_relaxed));
+    if (!head) {
+        ftr_notifier_signal_(n);
+    }
+    ftr_notifier_unref_(n);
+}
+
+int ftr_notify_(struct ftr_notifier* n, struct ftr_header* fh) {
+    struct ftr_notify_node_* nn = calloc(1, sizeof(struct ftr_notify_node_));
+    if (!nn) {
+        return ftr_nomem;
+    }
+    nn->notifier = n;
+    nn->future = fh;
+    nn->node.fn = ftr_notify_then_;
+    nn->node.userdata = nn;
+    if (fh->flags & ftr_flag_pshared) {
+        free(nn);
+        return ftr_invalid;
+    }
+    atomic_fetch_add_explicit(&n->refs, 1, memory_order_relaxed);
+    return ftr_then_node_(fh, &nn->node);
+}
+
+size_t ftr_notifier_drain_(struct ftr_notifier* n, struct ftr_header** futures, size_t max) {
+    // Reset before taking the queue: anything pushed after this signals again.
+    ftr_notifier_reset_(n);
+
+    size_t count = 0;
+    while (count < max) {
+        if (!n->backlog) {
+            // Also once the backlog ran out: whatever was pushed meanwhile signalled before the reset.
+            struct ftr_notify_node_* list = atomic_exchange_explicit(&n->ready, NULL, memory_order_acquire);
+            if (!list) {
+                break;
+            }
+            while (list) { // Oldest first
+                struct ftr_notify_node_* next = list->next;
+                list->next = n->backlog;
+                n->backlog = list;
+                list = next;
+            }
+        }
+        struct ftr_notify_node_* nn = n->backlog;
+        n->backlog = nn->next;
+        futures[count++] = nn->future;
+        free(nn);
+    }
+    if (n->backlog || atomic_load_explicit(&n->ready, memory_order_relaxed)) {
+        ftr_notifier_signal_(n); // Stay readable until everything was drained
+    }
+    return count;
+}
+
+void ftr_notifier_destroy(struct ftr_notifier* n) {
+    atomic_store_explicit(&n->closed, true, memory_order_release);
+
+    struct ftr_header* futures[64];
+    size_t count;
+    while ((count = ftr_notifier_drain_(n, futures, 64))) {
+        for (size_t i = 0; i < count; i++) {
+            ftr_delete_(futures[i]);
+        }
+    }
+    ftr_notifier_unref_(n);
+}
+
+#endif
+
+const char* ftr_errorstr(int err) {
+    switch (err) {
+    case ftr_success:   return "ftr_success";
+    case ftr_invalid:   return "ftr_invalid: Invalid future object";
+    case ftr_timedout:  return "ftr_timedout: Operation timed out";
+    case ftr_nomem:     return "ftr_nomem: No memory available";
+    case ftr_destsize:  return "ftr_destsize: The destination size is different from the value size";
+    case ftr_cancelled: return "ftr_cancelled: The future was cancelled";
+    case ftr_broken:    return "ftr_broken: The promise was released without a value";
+    default:            return "ftr_errorstr: Unknown error";
+    }
+}
+
+#endif
+
+#ifdef ftr_unittest
+
+#include <assert.h>
+
+typedef ftr_of(int) int_future_t;
+
+int run_async_task(void* arg) {
+    int_future_t* fut = arg;
+    thrd_sleep(&(struct timespec){.tv_sec=2}, NULL);
+    int err = ftr_complete(fut, 42);
+    if (err) {
+        fprintf(stderr, "error completing future: %s\n", ftr_errorstr(err));
+        return 1;
+    }
+    return 0;
+}
+
+int run_async_task_veryslow(void* arg) {
+    int_future_t* fut = arg;
+    thrd_sleep(&(struct timespec){.tv_sec=5}, NULL);
+    int err = ftr_complete(fut, 42);
+    if (err) {
+        fprintf(stderr, "error completing future: %s\n", ftr_errorstr(err));
+        return 1;
+    }
+    return 0;
+}
+
+typedef ftr_of(int16_t) int16_future_t;
+
+bool ftr_test_valuesize() {
+    printf("ftr_test_valuesize\n");
+
+    int16_future_t* fut = ftr_new(int16_future_t);
+    printf("fut->header.value_size = %zu, sizeof = %zu\n", fut->header.value_size, sizeof(int16_t));
+    assert(fut->header.value_size == sizeof(int16_t));
+#ifdef ftr_use_futex
+    printf("sizeof(struct ftr_header) = %zu\n", sizeof(struct ftr_header));
+    assert(sizeof(struct ftr_header) <= 6 * sizeof(size_t));
+#endif
+    ftr_delete(fut);
+    return true;
+}
+
+bool ftr_test_samethread() {
+    printf("ftr_test_samethread\n");
+    
+    int_future_t* fut = ftr_new(int_future_t);
+    assert(fut);
+    assert(fut->value == 0 || !"value is zero initialized");
+    assert(fut->header.state == ftr_pending || !"is pending");
+
+    ftr_complete(fut, 42);
+
+    int result;
+    int err = ftr_get(fut, 10*1000, &result); if (err) {
+        fprintf(stderr, "error getting future: %s\n", ftr_errorstr(err));
+        ftr_delete(fut);
+        return false;
+    }
+
+    assert(result == 42);
+
+    return true;
+}
+
+bool ftr_test_twice() {
+    printf("ftr_test_twice\n");
+
+    int_future_t* fut = ftr_new(int_future_t);
+    ftr_complete(fut, 42);
+
+    int result;
+    int err = ftr_get(fut, 10*1000, &result); if (err) {
+        fprintf(stderr, "error getting future: %s\n", ftr_errorstr(err));
+        ftr_delete(fut);
+        return false;
+    }
+
+    err = ftr_complete(fut, 100);
+    assert(err == ftr_invalid);
+
+    err = ftr_get(fut, 10*1000, &result);
+    assert(err == ftr_invalid);
+
+    ftr_delete(fut);
+    return true;
+}
+
+bool ftr_test_states() {
+    printf("ftr_test_states\n");
+
+    int_future_t* fut = ftr_new(int_future_t);
+    assert(fut->header.state == ftr_pending);
+    assert(ftr_wait(fut, 0) == ftr_timedout);
+
+    ftr_complete(fut, 7);
+    assert(fut->header.state == ftr_ready);
+    assert(ftr_wait(fut, 0) == ftr_success);
+
+    int result = 0;
+    int err = ftr_get(fut, 0, &result);
+    assert(err == ftr_success);
+    assert(result == 7);
+    assert(fut->header.state == ftr_consumed);
+
+    ftr_delete(fut);
+    return true;
+}
+
+bool ftr_test_success() {
+    printf("ftr_test_success\n");
+
+    int_future_t* fut = ftr_new(int_future_t);
+
+    thrd_t thread = {0};
+
+    thrd_create(&thread, run_async_task, fut);
+   
+    int result;
+    int err = ftr_get(fut, 4 * 1000, &result);
+    assert(err == ftr_success);
+    if (err) {
+        fprintf(stderr, "error waiting future: %s\n", ftr_errorstr(err));
+        thrd_join(thread, NULL);
+        ftr_delete(fut);
+        return false;
+    }
+ 
+    assert(result == 42);
+
+    thrd_join(thread, NULL);
+    ftr_delete(fut);
+    return true;
+}
+
+bool ftr_test_timedout() {
+    printf("ftr_test_timedout\n");
+
+    int_future_t* fut = ftr_new(int_future_t);
+
+    thrd_t thread = {0};
+
+    thrd_create(&thread, run_async_task_veryslow, fut);
+   
+    int result;
+    int err = ftr_get(fut, 4 * 1000, &result);
+    assert(err == ftr_timedout);
+    if (err) {
+        fprintf(stderr, "error waiting future: %s\n", ftr_errorstr(err));
+        thrd_join(thread, NULL);
+        ftr_delete(fut);
+        return true;
+    }
+ 
+    assert(result == 42);
+
+    thrd_join(thread, NULL);
+    ftr_delete(fut);
+    return false;
+}
+
+bool ftr_test_tryagain() {
+    printf("ftr_test_tryagain\n");
+
+    int_future_t* fut = ftr_new(int_future_t);
+
+    thrd_t thread = {0};
+
+    thrd_create(&thread, run_async_task_veryslow, fut);
+   
+    int result = 0;
+    int err;
+    
+    err = ftr_get(fut, 4 * 1000, &result);
+    assert(err == ftr_timedout);
+    assert(result == 0);
+
+    thrd_sleep(&(struct timespec){.tv_sec=2}, NULL);
+
+    err = ftr_get(fut, 4 * 1000, &result);
+    assert(err == ftr_success);
+    assert(result == 42);
+
+    thrd_join(thread, NULL);
+    ftr_delete(fut);
+    return true;
+}
+
+bool ftr_test_wait() {
+    printf("ftr_test_wait\n");
+
+    int_future_t* fut = ftr_new(int_future_t);
+
+    thrd_t thread = {0};
+
+    thrd_create(&thread, run_async_task_veryslow, fut);
+   
+    int result = 0;
+    int err = ftr_timedout;
+
+    while (err == ftr_timedout) {
+        err = ftr_wait(fut, 0);
+        printf("ftr_test_wait: %s\n", ftr_errorstr(err));
+
+        if (err != ftr_timedout && err != ftr_success) {
+            thrd_join(thread, NULL);
+            ftr_delete(fut);
+            return false;
+        }
+
+        thrd_sleep(&(struct timespec){.tv_sec=1}, NULL);
+    }
+
+    err = ftr_get(fut, 4 * 1000, &result);
+    assert(err == ftr_success);
+    assert(result == 42);
+
+    thrd_join(thread, NULL);
+    ftr_delete(fut);
+    return true;
+}
+
+struct data {
+    char name[64];
+    int x;
+    int y;
+};
+
+typedef ftr_of(struct data) data_future_t;
+
+int run_async_task_struct(void* arg) {
+    data_future_t* fut = arg;
+    thrd_sleep(&(struct timespec){.tv_sec=2}, NULL);
+
+    struct data mydata = { "foobar", 200, 400 };
+    int err = ftr_complete(fut, mydata);
+    if (err) {
+        fprintf(stderr, "error completing future: %s\n", ftr_errorstr(err));
+        return 1;
+    }
+    return 0;
+}
+
+bool ftr_test_struct() {
+    printf("ftr_test_struct\n");
+
+    data_future_t* fut = ftr_new(data_future_t);
+
+    thrd_t thread = {0};
+
+    thrd_create(&thread, run_async_task_struct, fut);
+   
+    struct data result;
+    int err = ftr_get(fut, 4 * 1000, &result);
+    assert(err == ftr_success);
+    if (err) {
+        fprintf(stderr, "error waiting future: %s\n", ftr_errorstr(err));
+        thrd_join(thread, NULL);
+        ftr_delete(fut);
+        return false;
+    }
+ 
+    assert(!strcmp(result.name, "foobar"));
+    assert(result.x == 200);
+    assert(result.y == 400);
+
+    thrd_join(thread, NULL);
+    ftr_delete(fut);
+    return true;
+}
+
+typedef struct { char bytes[4096]; } page_t;
+
+typedef ftr_of(page_t) page_future_t;
+
+bool ftr_test_inplace() {
+    printf("ftr_test_inplace\n");
+
+    page_future_t* fut = ftr_new(page_future_t);
+    page_t* slot = ftr_emplace(fut);
+    assert(slot == &fut->value);
+    assert(ftr_emplace(fut) == NULL || !"already claimed");
+
+    memset(slot->bytes, 'x', sizeof(slot->bytes));
+    int err = ftr_publish(fut);
+    assert(err == ftr_success);
+    assert(ftr_publish(fut) == ftr_invalid);
+
+    const page_t* result = NULL;
+    assert(ftr_peek(fut, 0, &result) == ftr_success);
+    assert(result == &fut->value || !"peek doesn't copy");
+    assert(result->bytes[0] == 'x' && result->bytes[4095] == 'x');
+    ftr_delete(fut);
+
+    fut = ftr_new(page_future_t);
+    static page_t page;
+    memset(page.bytes, 'y', sizeof(page.bytes));
+    err = ftr_complete_ptr(fut, &page);
+    assert(err == ftr_success);
+    assert(ftr_complete_ptr(fut, &page) == ftr_invalid);
+
+    static page_t out;
+    err = ftr_get(fut, 0, &out);
+    assert(err == ftr_success);
+    assert(!memcmp(out.bytes, page.bytes, sizeof(page.bytes)));
+
+    ftr_delete(fut);
+    return true;
+}
+
+bool ftr_test_peek() {
+    printf("ftr_test_peek\n");
+
+    data_future_t* fut = ftr_new(data_future_t);
+
+    const struct data* borrowed = NULL;
+    int err = ftr_peek(fut, 0, &borrowed);
+    assert(err == ftr_timedout);
+    assert(borrowed == NULL);
+
+    thrd_t thread = {0};
+    thrd_create(&thread, run_async_task_struct, fut);
+
+    err = ftr_peek(fut, 4 * 1000, &borrowed);
+    assert(err == ftr_success);
+    assert(!strcmp(borrowed->name, "foobar"));
+
+    // Peeking doesn't consume, a second reader sees the same value.
+    const struct data* again = NULL;
+    err = ftr_peek(fut, 0, &again);
+    assert(err == ftr_success);
+    assert(again == borrowed);
+
+    struct data result;
+    err = ftr_get(fut, 0, &result);
+    assert(err == ftr_success);
+    assert(result.x == borrowed->x && result.y == borrowed->y);
+
+    thrd_join(thread, NULL);
+    ftr_delete(fut);
+    return true;
+}
+
+typedef ftr_shared_of(int) int_shared_future_t;
+
+static atomic_int ftr_test_shared_sum;
+
+int run_shared_consumer(void* arg) {
+    int_shared_future_t* fut = arg;
+    int result = 0;
+    int err = ftr_get(fut, 4 * 1000, &result);
+    if (err) {
+        fprintf(stderr, "error getting shared future: %s\n", ftr_errorstr(err));
+    } else {
+        atomic_fetch_add(&ftr_test_shared_sum, result);
+    }
+    ftr_delete(fut);
+    return err;
+}
+
+bool ftr_test_shared() {
+    printf("ftr_test_shared\n");
+
+    int_shared_future_t* fut = ftr_shared_new(int_shared_future_t);
+    assert(fut->header.flags & ftr_flag_shared);
+
+    enum { nconsumers = 8 };
+    thrd_t threads[nconsumers];
+    for (int i = 0; i < nconsumers; i++) {
+        thrd_create(&threads[i], run_shared_consumer, ftr_shared_ref(fut));
+    }
+
+    thrd_sleep(&(struct timespec){.tv_nsec=100*1000*1000}, NULL);
+    int err = ftr_complete(fut, 5);
+    assert(err == ftr_success);
+
+    int result = 0;
+    err = ftr_get(fut, 0, &result);
+    assert(err == ftr_success);
+    assert(result == 5);
+    ftr_delete(fut);
+
+    bool ok = true;
+    for (int i = 0; i < nconsumers; i++) {
+        int res = 1;
+        thrd_join(threads[i], &res);
+        ok = ok && res == 0;
+    }
+    assert(ok);
+    assert(ftr_test_shared_sum == 5 * nconsumers);
+    return ok;
+}
+
+int run_pool_worker(void* arg) {
+    struct ftr_pool* pool = arg;
+    for (int i = 0; i < 1000; i++) {
+        int_future_t* fut = ftr_pool_acquire(pool);
+        if (!fut) {
+            return 1;
+        }
+        int result = 0;
+        if (ftr_complete(fut, i) || ftr_get(fut, 0, &result) || result != i) {
+            return 1;
+        }
+        ftr_pool_release(pool, fut);
+    }
+    return 0;
+}
+
+struct pool_sweep {
+    struct ftr_pool* pools[ftr_pool_cache_slots];
+    int_future_t* used;
+    int_future_t* destroyed;
+};
+
+// Fills every cache entry of this thread, then needs one more after the pools are gone.
+int run_pool_sweep(void* arg) {
+    struct pool_sweep* ps = arg;
+    for (size_t i = 0; i < ftr_pool_cache_slots; i++) {
+        ftr_pool_release(ps->pools[i], ftr_pool_acquire(ps->pools[i]));
+    }
+    ftr_complete(ps->used, 1);
+    ftr_wait(ps->destroyed, 4 * 1000);
+
+    struct ftr_pool* pool = ftr_pool_create(int_future_t, 4);
+    bool cached = ftr_pool_cache_(pool) != NULL;
+    ftr_pool_destroy(pool);
+    return cached ? 0 : 1;
+}
+
+bool ftr_test_pool() {
+    printf("ftr_test_pool\n");
+
+    struct ftr_pool* pool = ftr_pool_create(int_future_t, 4);
+    assert(pool);
+
+    // Going past the capacity grows the pool.
+    int_future_t* futs[6];
+    for (int i = 0; i < 6; i++) {
+        futs[i] = ftr_pool_acquire(pool);
+        assert(futs[i]);
+        assert(futs[i]->header.state == ftr_pending);
+    }
+
+    ftr_complete(futs[0], 1);
+    int result = 0;
+    assert(ftr_get(futs[0], 0, &result) == ftr_success && result == 1);
+
+    int_future_t* recycled = futs[0];
+    for (int i = 0; i < 5; i++) {
+        ftr_pool_release(pool, futs[i]);
+    }
+    ftr_delete(futs[5]); // Also goes back to the pool
+
+    // The last released slot comes back first, already re-armed.
+    int_future_t* again = ftr_pool_acquire(pool);
+    assert(again == futs[5]);
+    ftr_pool_release(pool, again);
+    bool found = false;
+    for (int i = 0; i < 6; i++) {
+        futs[i] = ftr_pool_acquire(pool);
+        found = found || futs[i] == recycled;
+        assert((futs[i]->header.state & ftr_state_mask) == ftr_pending); // In a later generation
+    }
+    assert(found);
+    for (int i = 0; i < 6; i++) {
+        ftr_pool_release(pool, futs[i]);
+    }
+
+    enum { nworkers = 4 };
+    thrd_t threads[nworkers];
+    for (int i = 0; i < nworkers; i++) {
+        thrd_create(&threads[i], run_pool_worker, pool);
+    }
+    bool ok = true;
+    for (int i = 0; i < nworkers; i++) {
+        int res = 1;
+        thrd_join(threads[i], &res);
+        ok = ok && res == 0;
+    }
+    assert(ok);
+
+    ftr_pool_destroy(pool);
+
+    // Pools destroyed by another thread don't keep this one's cache entries.
+    struct pool_sweep ps = { {0}, ftr_new(int_future_t), ftr_new(int_future_t) };
+    for (size_t i = 0; i < ftr_pool_cache_slots; i++) {
+        ps.pools[i] = ftr_pool_create(int_future_t, 4);
+    }
+    thrd_t thread;
+    thrd_create(&thread, run_pool_sweep, &ps);
+    ftr_wait(ps.used, 4 * 1000);
+    for (size_t i = 0; i < ftr_pool_cache_slots; i++) {
+        ftr_pool_destroy(ps.pools[i]);
+    }
+    ftr_complete(ps.destroyed, 1);
+    int res = 1;
+    thrd_join(thread, &res);
+    assert(res == 0);
+    ftr_delete(ps.used);
+    ftr_delete(ps.destroyed);
+    return ok;
+}
+
+void array_then(void* userdata, void* future) {
+    (void)future;
+    ++*(int*)userdata;
+}
+
+bool ftr_test_array() {
+    printf("ftr_test_array\n");
+
+    enum { n = 8 };
+    int16_future_t* futs = ftr_new_array(int16_future_t, n);
+    assert(futs);
+
+    for (int i = 0; i < n; i++) {
+        int16_future_t* fut = ftr_array_at(futs, i);
+        assert((uintptr_t)fut % ftr_cacheline == 0);
+        assert(fut->header.state == ftr_pending);
+        assert(fut->value == 0);
+        assert(ftr_complete(fut, (int16_t)(i * 10)) == ftr_success);
+    }
+
+    for (int i = 0; i < n; i++) {
+        int16_future_t* fut = ftr_array_at(futs, i);
+        int16_t result = -1;
+        assert(ftr_get(fut, 0, &result) == ftr_success);
+        assert(result == i * 10);
+        ftr_delete(fut); // No-op for array elements
+    }
+
+    // References taken by continuations are still dropped, so elements can be reset.
+    int16_future_t* fut = ftr_array_at(futs, 0);
+    assert(ftr_reset(fut) == ftr_success);
+    int calls = 0;
+    assert(ftr_then(fut, array_then, &calls) == ftr_success);
+    assert(fut->header.refs == 2);
+    ftr_complete(fut, 1);
+    assert(calls == 1 && fut->header.refs == 1);
+    assert(ftr_reset(fut) == ftr_success);
+
+    ftr_delete_array(futs, n);
+    return true;
+}
+
+void square_task(void* arg, void* value) {
+    intptr_t x = (intptr_t)arg;
+    *(int*)value = (int)(x * x);
+}
+
+static atomic_int ftr_test_executor_count;
+
+void count_task(void* arg, void* value) {
+    (void)value;
+    struct ftr_executor* exec = arg;
+    if (atomic_fetch_add(&ftr_test_executor_count, 1) < 50) {
+        ftr_executor_submit(exec, count_task, exec); // From a worker: goes to its own deque
+    }
+}
+
+bool ftr_test_executor() {
+    printf("ftr_test_executor\n");
+
+    struct ftr_executor* exec = ftr_executor_create(4);
+    assert(exec);
+
+    enum { ntasks = 100 };
+    int_future_t* futs[ntasks];
+    for (intptr_t i = 0; i < ntasks; i++) {
+        futs[i] = ftr_async(exec, int_future_t, square_task, (void*)i);
+        assert(futs[i]);
+    }
+    for (int i = 0; i < ntasks; i++) {
+        int result = -1;
+        int err = ftr_get(futs[i], 4 * 1000, &result);
+        assert(err == ftr_success);
+        assert(result == i * i);
+        ftr_delete(futs[i]);
+    }
+
+    // Deleting before the task ran is fine, the executor holds its own reference.
+    ftr_delete(ftr_async(exec, int_future_t, square_task, (void*)3));
+
+    ftr_executor_submit(exec, count_task, exec);
+
+    // Destroying the executor runs everything still queued.
+    ftr_executor_destroy(exec);
+    assert(ftr_test_executor_count == 51);
+    return true;
+}
+
+struct then_log {
+    atomic_int calls;
+    int order[4];
+    thrd_t thread;
+};
+
+void log_then(void* userdata, void* future) {
+    struct then_log* log = userdata;
+    int_future_t* fut = future;
+    int i = atomic_fetch_add(&log->calls, 1);
+    log->order[i] = fut->value + i;
+    log->thread = thrd_current();
+}
+
+bool ftr_test_then() {
+    printf("ftr_test_then\n");
+
+    struct then_log log = {0};
+    int_future_t* fut = ftr_new(int_future_t);
+
+    assert(ftr_then(fut, log_then, &log) == ftr_success);
+    assert(ftr_then(fut, log_then, &log) == ftr_success);
+    assert(log.calls == 0);
+
+    ftr_complete(fut, 10);
+    assert(log.calls == 2);
+    assert(log.order[0] == 10 && log.order[1] == 11);
+
+    // Already complete: runs right away.
+    assert(ftr_then(fut, log_then, &log) == ftr_success);
+    assert(log.calls == 3);
+    ftr_delete(fut);
+
+    // On an executor, the callback keeps the future alive after we delete it.
+    struct ftr_executor* exec = ftr_executor_create(1);
+    struct then_log remote = {0};
+    fut = ftr_new(int_future_t);
+    ftr_then_on(exec, fut, log_then, &remote);
+    ftr_complete(fut, 20);
+    ftr_delete(fut);
+    ftr_executor_destroy(exec);
+    assert(remote.calls == 1);
+    assert(remote.order[0] == 20);
+    assert(!thrd_equal(remote.thread, thrd_current()));
+    return true;
+}
+
+struct delayed_completion {
+    int_future_t* fut;
+    int value;
+    long delay_ms;
+};
+
+int run_delayed_completion(void* arg) {
+    struct delayed_completion* dc = arg;
+    thrd_sleep(&(struct timespec){.tv_sec=dc->delay_ms/1000, .tv_nsec=(dc->delay_ms%1000)*1000000}, NULL);
+    return ftr_complete(dc->fut, dc->value);
+}
+
+enum { ftr_test_error = ftr_cancelled + 100 };
+
+int run_delayed_fail(void* arg) {
+    struct delayed_completion* dc = arg;
+    thrd_sleep(&(struct timespec){.tv_sec=dc->delay_ms/1000, .tv_nsec=(dc->delay_ms%1000)*1000000}, NULL);
+    return ftr_fail(dc->fut, ftr_test_error);
+}
+
+bool ftr_test_when() {
+    printf("ftr_test_when\n");
+
+    enum { n = 4 };
+    int_future_t* futs[n];
+    struct delayed_completion dcs[n];
+    thrd_t threads[n];
+    for (int i = 0; i < n; i++) {
+        futs[i] = ftr_new(int_future_t);
+        dcs[i] = (struct delayed_completion){ futs[i], i, 400 - i * 100 };
+    }
+
+    size_t index = n;
+    assert(ftr_wait_any(futs, n, 0, &index) == ftr_timedout);
+    assert(ftr_wait_all(futs, n, 0) == ftr_timedout);
+
+    for (int i = 0; i < n; i++) {
+        thrd_create(&threads[i], run_delayed_completion, &dcs[i]);
+    }
+
+    // Last one has the shortest delay.
+    int err = ftr_wait_any(futs, n, 4 * 1000, &index);
+    assert(err == ftr_success);
+    assert(index == n - 1);
+
+    // Times out, its continuations on the inputs still fire later.
+    err = ftr_wait_all(futs, n, 50);
+    assert(err == ftr_timedout);
+
+    ftr_when_future_t* all = ftr_when_all(futs, n);
+    err = ftr_wait_all(futs, n, 4 * 1000);
+    assert(err == ftr_success);
+    for (int i = 0; i < n; i++) {
+        assert(futs[i]->header.state == ftr_ready);
+    }
+    size_t count = 0;
+    assert(ftr_get(all, 0, &count) == ftr_success);
+    assert(count == n);
+    ftr_delete(all);
+
+    ftr_when_future_t* any = ftr_when_any(futs, n);
+    assert(ftr_get(any, 0, &index) == ftr_success);
+    assert(index == 0 || !"first ready in registration order");
+    ftr_delete(any);
+
+    for (int i = 0; i < n; i++) {
+        thrd_join(threads[i], NULL);
+        ftr_delete(futs[i]);
+    }
+    return true;
+}
+
+bool ftr_test_spin() {
+    printf("ftr_test_spin\n");
+
+    struct ftr_wait_stats before, after;
+    int_future_t* fut = ftr_new(int_future_t);
+    struct delayed_completion dc = { fut, 1, 100 };
+    thrd_t thread = {0};
+
+    // No spinning or yielding: the wait has to park.
+    ftr_set_default_spin(0, 0);
+    ftr_get_wait_stats(&before);
+    thrd_create(&thread, run_delayed_completion, &dc);
+    assert(ftr_wait(fut, 4 * 1000) == ftr_success);
+    ftr_get_wait_stats(&after);
+    assert(after.parked == before.parked + 1);
+    assert(after.spun == before.spun && after.yielded == before.yielded);
+    thrd_join(thread, NULL);
+    ftr_delete(fut);
+
+    // Every slow-path wait is accounted to exactly one phase.
+    ftr_set_default_spin(ftr_default_spins, ftr_default_yields);
+    fut = ftr_new(int_future_t);
+    ftr_set_spin(fut, 1000 * 1000);
+    dc = (struct delayed_completion){ fut, 1, 0 };
+    ftr_get_wait_stats(&before);
+    thrd_create(&thread, run_delayed_completion, &dc);
+    assert(ftr_wait(fut, 4 * 1000) == ftr_success);
+    ftr_get_wait_stats(&after);
+    printf("spun = %d, yielded = %d, parked = %d\n", (int)(after.spun - before.spun),
+           (int)(after.yielded - before.yielded), (int)(after.parked - before.parked));
+    assert(after.spun + after.yielded + after.parked <= before.spun + before.yielded + before.parked + 1);
+    thrd_join(thread, NULL);
+    ftr_delete(fut);
+    return true;
+}
+
+static int64_t elapsed_us(const struct timespec* start) {
+    struct timespec now;
+    ftr_now(&now);
+    return (int64_t)(now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+bool ftr_test_deadline() {
+    printf("ftr_test_deadline\n");
+
+    int_future_t* fut = ftr_new(int_future_t);
+    struct timespec start, deadline;
+
+    // The whole timeout elapses, including the sub-second part.
+    ftr_now(&start);
+    assert(ftr_wait(fut, 300) == ftr_timedout);
+    int64_t us = elapsed_us(&start);
+    printf("ftr_wait(300ms): %dus\n", (int)us);
+    assert(us >= 300 * 1000);
+
+    ftr_now(&start);
+    assert(ftr_wait_us(fut, 500) == ftr_timedout);
+    us = elapsed_us(&start);
+    printf("ftr_wait_us(500us): %dus\n", (int)us);
+    assert(us >= 500 && us < 500 * 1000);
+
+    // A deadline in the past doesn't wait at all.
+    ftr_now(&deadline);
+    assert(ftr_wait_until(fut, &deadline) == ftr_timedout);
+
+    struct delayed_completion dc = { fut, 9, 50 };
+    thrd_t thread = {0};
+    thrd_create(&thread, run_delayed_completion, &dc);
+
+    int result = 0;
+    ftr_deadline_in(&deadline, 4 * 1000 * 1000);
+    assert(ftr_get_until(fut, &deadline, &result) == ftr_success);
+    assert(result == 9);
+
+    thrd_join(thread, NULL);
+    ftr_delete(fut);
+    return true;
+}
+
+static atomic_int ftr_test_cancel_calls;
+
+void count_cancel(void* userdata, void* future) {
+    (void)userdata;
+    assert(ftr_is_cancelled(future));
+    atomic_fetch_add(&ftr_test_cancel_calls, 1);
+}
+
+int run_wait(void* arg) {
+    return ftr_wait((int_future_t*)arg, 4 * 1000);
+}
+
+void wait_gate_task(void* arg, void* value) {
+    (void)value;
+    ftr_wait((int_future_t*)arg, 4 * 1000);
+}
+
+bool ftr_test_cancel() {
+    printf("ftr_test_cancel\n");
+
+    int_future_t* fut = ftr_new(int_future_t);
+    assert(!ftr_is_cancelled(fut));
+    ftr_on_cancel(fut, count_cancel, NULL);
+
+    assert(ftr_cancel(fut) == ftr_success);
+    assert(ftr_is_cancelled(fut));
+    assert(ftr_test_cancel_calls == 1);
+    assert(ftr_cancel(fut) == ftr_invalid);
+
+    int result = 0;
+    assert(ftr_wait(fut, 0) == ftr_cancelled);
+    assert(ftr_get(fut, 0, &result) == ftr_cancelled);
+    assert(ftr_complete(fut, 1) == ftr_cancelled);
+    ftr_delete(fut);
+
+    // Completed futures can't be cancelled, and their cancel callbacks never run.
+    fut = ftr_new(int_future_t);
+    ftr_on_cancel(fut, count_cancel, NULL);
+    ftr_complete(fut, 1);
+    assert(ftr_cancel(fut) == ftr_invalid);
+    assert(ftr_test_cancel_calls == 1);
+    ftr_delete(fut);
+
+    // A parked waiter is woken by the cancellation.
+    fut = ftr_new(int_future_t);
+    thrd_t thread = {0};
+    thrd_create(&thread, run_wait, fut);
+    thrd_sleep(&(struct timespec){.tv_nsec=50*1000*1000}, NULL);
+    ftr_cancel(fut);
+    int res = 0;
+    thrd_join(thread, &res);
+    assert(res == ftr_cancelled);
+    ftr_delete(fut);
+
+    // Queued behind the gate and cancelled before it gets to run: the task is skipped.
+    struct ftr_executor* exec = ftr_executor_create(1);
+    int_future_t* gate = ftr_new(int_future_t);
+    ftr_executor_submit(exec, wait_gate_task, gate);
+
+    int calls_before = ftr_test_executor_count;
+    int_future_t* task = ftr_async(exec, int_future_t, count_task, exec);
+    assert(ftr_cancel(task) == ftr_success);
+    assert(ftr_get(task, 0, &result) == ftr_cancelled);
+    ftr_delete(task);
+
+    ftr_complete(gate, 0);
+    ftr_executor_destroy(exec);
+    assert(ftr_test_executor_count == calls_before);
+    ftr_delete(gate);
+    return true;
+}
+
+struct then_count {
+    atomic_int calls;
+};
+
+void count_then(void* userdata, void* future) {
+    (void)future;
+    atomic_fetch_add(&((struct then_count*)userdata)->calls, 1);
+}
+
+struct racing_fail {
+    int_future_t* fut;
+    ftr_when_future_t* start;
+    atomic_int wins;
+};
+
+int run_racing_fail(void* arg) {
+    struct racing_fail* rf = arg;
+    ftr_wait(rf->start, 4 * 1000);
+    if (ftr_fail(rf->fut, ftr_test_error) == ftr_success) {
+        atomic_fetch_add(&rf->wins, 1);
+    }
+    return 0;
+}
+
+bool ftr_test_fail() {
+    printf("ftr_test_fail\n");
+
+    int_future_t* fut = ftr_new(int_future_t);
+    assert(ftr_fail(fut, 0) == ftr_invalid);
+    assert(ftr_fail(fut, ftr_test_error) == ftr_success);
+    assert(ftr_fail(fut, ftr_test_error) == ftr_invalid);
+    assert(ftr_complete(fut, 1) == ftr_invalid);
+
+    int result = 0;
+    assert(ftr_wait(fut, 0) == ftr_test_error);
+    assert(ftr_get(fut, 0, &result) == ftr_test_error);
+    assert(result == 0);
+    ftr_delete(fut);
+
+    // Failing after claiming the slot.
+    fut = ftr_new(int_future_t);
+    struct then_count claimed = {0};
+    assert(ftr_then(fut, count_then, &claimed) == ftr_success);
+    assert(ftr_emplace(fut));
+    assert(ftr_fail(fut, ftr_error) == ftr_invalid); // Only the claimer may publish
+    assert(atomic_load(&claimed.calls) == 0);
+    assert(ftr_publish_error(fut, ftr_error) == ftr_success);
+    assert(ftr_publish_error(fut, ftr_error) == ftr_invalid);
+    assert(ftr_publish(fut) == ftr_invalid);
+    assert(atomic_load(&claimed.calls) == 1);
+    assert(ftr_get(fut, 0, &result) == ftr_error);
+    ftr_delete(fut);
+
+    // Concurrent failures: one wins, continuations run once.
+    for (int round = 0; round < 200; round++) {
+        struct then_count tc = {0};
+        fut = ftr_new(int_future_t);
+        assert(ftr_then(fut, count_then, &tc) == ftr_success);
+        struct racing_fail rf = { fut, ftr_shared_new(ftr_when_future_t), 0 };
+        thrd_t racers[2];
+        for (int i = 0; i < 2; i++) {
+            thrd_create(&racers[i], run_racing_fail, &rf);
+        }
+        ftr_complete(rf.start, 0);
+        for (int i = 0; i < 2; i++) {
+            thrd_join(racers[i], NULL);
+        }
+        assert(atomic_load(&rf.wins) == 1 && atomic_load(&tc.calls) == 1);
+        assert(ftr_wait(fut, 0) == ftr_test_error);
+        ftr_delete(rf.start);
+        ftr_delete(fut);
+    }
+
+    // ftr_wait_all returns as soon as one input fails.
+    int_future_t* futs[2] = { ftr_new(int_future_t), ftr_new(int_future_t) };
+    struct delayed_completion dc = { futs[1], 0, 50 };
+    thrd_t thread = {0};
+    thrd_create(&thread, run_delayed_fail, &dc);
+
+    struct timespec start;
+    ftr_now(&start);
+    assert(ftr_wait_all(futs, 2, 4 * 1000) == ftr_test_error);
+    assert(elapsed_us(&start) < 2 * 1000 * 1000);
+    assert(futs[0]->header.state == ftr_pending);
+
+    thrd_join(thread, NULL);
+    ftr_cancel(futs[0]); // Lets go of the reference held by the wait_all continuation
+    ftr_delete(futs[0]);
+    ftr_delete(futs[1]);
+
+    // Inputs that already failed short-circuit too, done or pending as the others may be.
+    futs[0] = ftr_new(int_future_t);
+    futs[1] = ftr_new(int_future_t);
+    ftr_complete(futs[0], 1);
+    ftr_fail(futs[1], ftr_test_error);
+    assert(ftr_wait_all(futs, 2, 0) == ftr_test_error);
+    ftr_delete(futs[0]);
+    futs[0] = ftr_new(int_future_t);
+    int_future_t* failed_first[2] = { futs[1], futs[0] };
+    ftr_now(&start);
+    assert(ftr_wait_all(failed_first, 2, 4 * 1000) == ftr_test_error);
+    assert(ftr_wait_all(futs, 2, 4 * 1000) == ftr_test_error);
+    assert(elapsed_us(&start) < 2 * 1000 * 1000);
+    ftr_cancel(futs[0]);
+    assert(ftr_wait_all(futs, 2, 0) == ftr_cancelled);
+    ftr_delete(futs[0]);
+    ftr_delete(futs[1]);
+    return true;
+}
+
+typedef ftr_promise_of(int_future_t) int_promise_t;
+
+typedef ftr_future_of(int_future_t) int_handle_t;
+
+int run_promise_producer(void* arg) {
+    int_promise_t* promise = arg;
+    thrd_sleep(&(struct timespec){.tv_nsec=50*1000*1000}, NULL);
+    int err = ftr_promise_complete(promise, 42);
+    free(promise);
+    return err;
+}
+
+bool ftr_test_batch() {
+    printf("ftr_test_batch\n");
+
+    enum { n = 70 }; // More than one chunk
+    int_future_t* futs[n];
+    int values[n];
+    for (int i = 0; i < n; i++) {
+        futs[i] = ftr_new(int_future_t);
+        values[i] = i * 10;
+    }
+
+    thrd_t waiter;
+    ftr_set_spin(futs[65], 0);
+    thrd_create(&waiter, run_wait, futs[65]);
+    thrd_sleep(&(struct timespec){.tv_nsec=50*1000*1000}, NULL);
+
+    struct then_log log = {0};
+    ftr_then(futs[3], log_then, &log);
+    ftr_cancel(futs[10]);
+
+    // The cancelled future is reported, the others are still completed.
+    assert(ftr_complete_batch(futs, values, n) == ftr_cancelled);
+    assert(log.calls == 1 && log.order[0] == 30);
+
+    int res = 0;
+    thrd_join(waiter, &res);
+    assert(res == ftr_success);
+    for (int i = 0; i < n; i++) {
+        int value = -1;
+        assert(ftr_get(futs[i], 0, &value) == (i == 10 ? ftr_cancelled : ftr_success));
+        assert(i == 10 || value == i * 10);
+    }
+
+    // Already complete now.
+    assert(ftr_complete_batch(futs, values, 2) == ftr_invalid);
+
+    int16_t narrow[n] = {0};
+    int_future_t* fresh = ftr_new(int_future_t);
+    assert(ftr_complete_batch_((struct ftr_header**)&fresh, narrow, sizeof(narrow[0]), 1, 0) == ftr_destsize);
+    assert(ftr_wait(fresh, 0) == ftr_timedout);
+    ftr_delete(fresh);
+
+    for (int i = 0; i < n; i++) {
+        ftr_delete(futs[i]);
+    }
+    return true;
+}
+
+typedef ftr_channel_of(int) int_channel_t;
+
+enum { ftr_test_channel_n = 20000 };
+
+int run_channel_producer(void* arg) {
+    int_channel_t* chan = arg;
+    for (int i = 1; i <= ftr_test_channel_n; i++) {
+        if (ftr_channel_send(chan, 4 * 1000, &i)) { return 1; }
+    }
+    return 0;
+}
+
+static atomic_llong ftr_test_channel_sum;
+
+int run_channel_consumer(void* arg) {
+    int_channel_t* chan = arg;
+    int values[16];
+    long long sum = 0;
+    for (int got = 0; got < ftr_test_channel_n;) {
+        size_t n = 0;
+        size_t max = ftr_test_channel_n - got < 16 ? (size_t)(ftr_test_channel_n - got) : 16;
+        if (ftr_channel_recv_batch(chan, 4 * 1000, values, max, &n)) { return 1; }
+        for (size_t i = 0; i < n; i++) { sum += values[i]; }
+        got += (int)n;
     }
- 
-    assert(result == 42);
+    atomic_fetch_add(&ftr_test_channel_sum, sum);
+    return 0;
+}
 
-    thrd_join(thread, NULL);
+bool ftr_test_reset() {
+    printf("ftr_test_reset\n");
+
+    int_future_t* fut = ftr_new(int_future_t);
+    uint32_t gen = ftr_generation(fut);
+    assert(ftr_reset(fut) == ftr_invalid); // Still pending
+
+    int value = 0;
+    for (int i = 0; i < 3; i++) {
+        assert(ftr_complete_gen(fut, gen, i) == ftr_success);
+        assert(ftr_get(fut, 0, &value) == ftr_success && value == i);
+        assert(ftr_reset(fut) == ftr_success);
+        assert(ftr_generation(fut) == gen + 1);
+
+        // A producer from the previous round can't complete the new one.
+        assert(ftr_complete_gen(fut, gen, 100) == ftr_invalid);
+        assert(ftr_wait(fut, 0) == ftr_timedout);
+        gen = ftr_generation(fut);
+    }
+
+    // Failed and cancelled futures start over without their error.
+    ftr_fail(fut, ftr_test_error);
+    assert(ftr_wait(fut, 0) == ftr_test_error);
+    assert(ftr_reset(fut) == ftr_success);
+    assert(ftr_wait(fut, 0) == ftr_timedout);
+    ftr_cancel(fut);
+    assert(ftr_reset(fut) == ftr_success);
+    assert(!ftr_is_cancelled(fut));
+
+    // Continuations registered after a reset run for the new value.
+    struct then_log log = {0};
+    ftr_then(fut, log_then, &log);
+    assert(ftr_complete(fut, 5) == ftr_success);
+    assert(log.calls == 1 && log.order[0] == 5);
+
+    // Not while someone else still holds a reference.
+    (void)ftr_shared_ref(fut);
+    assert(ftr_reset(fut) == ftr_invalid);
     ftr_delete(fut);
-    return false;
+    assert(ftr_reset(fut) == ftr_success);
+
+    // A parked waiter is woken by a completion after the reset.
+    thrd_t waiter;
+    ftr_set_spin(fut, 0);
+    thrd_create(&waiter, run_wait, fut);
+    thrd_sleep(&(struct timespec){.tv_nsec=50*1000*1000}, NULL);
+    assert(ftr_complete_gen(fut, ftr_generation(fut), 6) == ftr_success);
+    int res = -1;
+    thrd_join(waiter, &res);
+    assert(res == ftr_success);
+
+    ftr_delete(fut);
+    return true;
 }
 
-bool ftr_test_tryagain() {
-    printf("ftr_test_tryagain\n");
+bool ftr_test_channel() {
+    printf("ftr_test_channel\n");
+
+    assert(ftr_channel_new(int_channel_t, 0) == NULL);
+
+    // Rounded up to a power of two.
+    int_channel_t* chan = ftr_channel_new(int_channel_t, 3);
+    for (int i = 0; i < 4; i++) {
+        assert(ftr_channel_send(chan, 0, &i) == ftr_success);
+    }
+    int v = 4;
+    assert(ftr_channel_send(chan, 0, &v) == ftr_timedout);
+
+    int16_t narrow = 1;
+    assert(ftr_channel_send(chan, 0, &narrow) == ftr_destsize);
+
+    for (int i = 0; i < 4; i++) {
+        assert(ftr_channel_recv(chan, 0, &v) == ftr_success);
+        assert(v == i);
+    }
+    struct timespec start;
+    ftr_now(&start);
+    assert(ftr_channel_recv(chan, 50, &v) == ftr_timedout);
+    assert(elapsed_us(&start) >= 50 * 1000);
+
+    // Batches transfer what fits.
+    int values[10] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+    size_t n = 0;
+    assert(ftr_channel_send_batch(chan, 0, values, 10, &n) == ftr_success);
+    assert(n == 4);
+    int out[10] = {0};
+    assert(ftr_channel_recv_batch(chan, 0, out, 3, &n) == ftr_success);
+    assert(n == 3 && out[0] == 0 && out[2] == 2);
+    assert(ftr_channel_send_batch(chan, 0, values + 4, 6, &n) == ftr_success);
+    assert(n == 3);
+    assert(ftr_channel_recv_batch(chan, 0, out, 10, &n) == ftr_success);
+    assert(n == 4 && out[0] == 3 && out[3] == 6);
+    ftr_channel_delete(chan);
+
+    // Blocking producers and consumers through a small ring.
+    chan = ftr_channel_new(int_channel_t, 8);
+    atomic_store(&ftr_test_channel_sum, 0);
+    thrd_t threads[4];
+    thrd_create(&threads[0], run_channel_producer, chan);
+    thrd_create(&threads[1], run_channel_consumer, chan);
+    thrd_create(&threads[2], run_channel_producer, chan);
+    thrd_create(&threads[3], run_channel_consumer, chan);
+    for (int i = 0; i < 4; i++) {
+        int res = -1;
+        thrd_join(threads[i], &res);
+        assert(res == 0);
+    }
+    long long expected = 2LL * ftr_test_channel_n * (ftr_test_channel_n + 1) / 2;
+    assert(atomic_load(&ftr_test_channel_sum) == expected);
+    assert(ftr_channel_recv(chan, 0, &v) == ftr_timedout);
+    ftr_channel_delete(chan);
+    return true;
+}
 
+int run_stats_producer(void* arg) {
     int_future_t* fut = ftr_new(int_future_t);
+    ftr_complete(fut, 1);
+    ftr_delete(fut);
+    return ftr_complete((int_future_t*)arg, 2);
+}
 
-    thrd_t thread = {0};
+static uint64_t stats_latency_total(const struct ftr_stats* stats) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < ftr_stats_buckets; i++) {
+        total += stats->latency[i];
+    }
+    return total;
+}
 
-    thrd_create(&thread, run_async_task_veryslow, fut);
-   
-    int result = 0;
-    int err;
-    
-    err = ftr_get(fut, 4 * 1000, &result);
-    assert(err == ftr_timedout);
-    assert(result == 0);
+bool ftr_test_stats() {
+    printf("ftr_test_stats\n");
 
-    thrd_sleep(&(struct timespec){.tv_sec=2}, NULL);
+    struct ftr_stats before, after;
+    ftr_stats_snapshot(&before);
 
-    err = ftr_get(fut, 4 * 1000, &result);
-    assert(err == ftr_success);
-    assert(result == 42);
+    int_future_t* fut = ftr_new(int_future_t);
+    int value = 0;
+    assert(ftr_get(fut, 10, &value) == ftr_timedout);
+    ftr_complete(fut, 1);
+    assert(ftr_get(fut, 0, &value) == ftr_success);
+    ftr_delete(fut);
 
+    // Counters of a thread that already exited are kept.
+    fut = ftr_new(int_future_t);
+    thrd_t thread;
+    thrd_create(&thread, run_stats_producer, fut);
     thrd_join(thread, NULL);
+    assert(ftr_get(fut, 0, &value) == ftr_success && value == 2);
     ftr_delete(fut);
+
+    ftr_stats_snapshot(&after);
+#ifdef ftr_enable_stats
+    assert(after.creates == before.creates + 3);
+    assert(after.completions == before.completions + 3);
+    assert(after.gets_ready == before.gets_ready + 2);
+    assert(after.gets_blocked == before.gets_blocked + 1);
+    assert(after.timeouts == before.timeouts + 1);
+    assert(stats_latency_total(&after) == stats_latency_total(&before) + 2);
+#else
+    assert(after.creates == 0 && after.gets_blocked == 0 && stats_latency_total(&after) == 0);
+#endif
     return true;
 }
 
-bool ftr_test_wait() {
-    printf("ftr_test_wait\n");
+struct trace_log {
+    atomic_int creates;
+    atomic_int completes;
+    atomic_int wait_begins;
+    atomic_int wait_ends;
+    atomic_int destroys;
+    int last_result;
+    int64_t created_ns;
+    int64_t completed_ns;
+};
+
+void trace_create(void* userdata, struct ftr_header* fh, int64_t ts_ns) {
+    (void)fh;
+    struct trace_log* log = userdata;
+    log->created_ns = ts_ns;
+    atomic_fetch_add(&log->creates, 1);
+}
+
+void trace_complete(void* userdata, struct ftr_header* fh, int result, int64_t ts_ns) {
+    (void)fh;
+    struct trace_log* log = userdata;
+    log->last_result = result;
+    log->completed_ns = ts_ns;
+    atomic_fetch_add(&log->completes, 1);
+}
+
+void trace_wait_begin(void* userdata, struct ftr_header* fh, int64_t ts_ns) {
+    (void)fh;
+    (void)ts_ns;
+    atomic_fetch_add(&((struct trace_log*)userdata)->wait_begins, 1);
+}
+
+void trace_wait_end(void* userdata, struct ftr_header* fh, int result, int64_t ts_ns) {
+    (void)fh;
+    (void)ts_ns;
+    struct trace_log* log = userdata;
+    log->last_result = result;
+    atomic_fetch_add(&log->wait_ends, 1);
+}
+
+void trace_destroy(void* userdata, struct ftr_header* fh, int64_t ts_ns) {
+    (void)fh;
+    (void)ts_ns;
+    atomic_fetch_add(&((struct trace_log*)userdata)->destroys, 1);
+}
+
+bool ftr_test_trace() {
+    printf("ftr_test_trace\n");
+
+    struct trace_log log = {0};
+    struct ftr_trace_hooks hooks = {
+        .on_create = trace_create, .on_complete = trace_complete, .on_wait_begin = trace_wait_begin,
+        .on_wait_end = trace_wait_end, .on_destroy = trace_destroy, .userdata = &log,
+    };
+    ftr_set_trace_hooks(&hooks);
 
     int_future_t* fut = ftr_new(int_future_t);
+    assert(log.creates == 1);
 
-    thrd_t thread = {0};
+    // Only waits that find the future pending are traced.
+    assert(ftr_wait(fut, 0) == ftr_timedout);
+    assert(log.wait_begins == 0);
+    assert(ftr_wait(fut, 10) == ftr_timedout);
+    assert(log.wait_begins == 1 && log.wait_ends == 1 && log.last_result == ftr_timedout);
 
-    thrd_create(&thread, run_async_task_veryslow, fut);
-   
-    int result = 0;
-    int err = ftr_timedout;
+    ftr_complete(fut, 1);
+    assert(log.completes == 1 && log.last_result == ftr_success);
+    assert(log.completed_ns >= log.created_ns);
+    assert(ftr_wait(fut, 10) == ftr_success);
+    assert(log.wait_begins == 1);
+    ftr_delete(fut);
+    assert(log.destroys == 1);
 
-    while (err == ftr_timedout) {
-        err = ftr_wait(fut, 0);
-        printf("ftr_test_wait: %s\n", ftr_errorstr(err));
+    fut = ftr_new(int_future_t);
+    ftr_cancel(fut);
+    assert(log.completes == 2 && log.last_result == ftr_cancelled);
+    ftr_delete(fut);
 
-        if (err != ftr_timedout && err != ftr_success) {
-            thrd_join(thread, NULL);
-            ftr_delete(fut);
-            return false;
+    // Pooled futures are created and destroyed on every acquire/release.
+    struct ftr_pool* pool = ftr_pool_create(int_future_t, 4);
+    fut = ftr_pool_acquire(pool);
+    ftr_fail(fut, ftr_test_error);
+    assert(log.last_result == ftr_test_error);
+    ftr_pool_release(pool, fut);
+    ftr_pool_destroy(pool);
+    assert(log.creates == 3 && log.destroys == 3);
+
+    ftr_set_trace_hooks(NULL);
+    ftr_delete(ftr_new(int_future_t));
+    assert(log.creates == 3 && log.destroys == 3);
+    return true;
+}
+
+bool ftr_test_small() {
+    printf("ftr_test_small\n");
+
+    // Ready values of up to 8 bytes are taken inline, with the same outcomes as ftr_get_.
+    typedef ftr_of(int64_t) i64_future_t;
+    i64_future_t* fut = ftr_new(i64_future_t);
+    int64_t value = 0;
+    assert(ftr_get(fut, 0, &value) == ftr_timedout);
+    ftr_complete(fut, INT64_MAX);
+    assert(ftr_get(fut, 0, &value) == ftr_success && value == INT64_MAX);
+    assert(ftr_get(fut, 0, &value) == ftr_invalid);
+
+    // The generation survives the inline consume.
+    uint32_t gen = ftr_generation(fut);
+    assert(ftr_reset(fut) == ftr_success && ftr_generation(fut) == gen + 1);
+    ftr_fail(fut, ftr_test_error);
+    assert(ftr_get(fut, 0, &value) == ftr_test_error);
+    ftr_delete(fut);
+
+    // The future is evaluated once, like any function argument.
+    i64_future_t* futs[2] = { ftr_new(i64_future_t), ftr_new(i64_future_t) };
+    ftr_complete(futs[0], 5);
+    int next = 0;
+    assert(ftr_get(futs[next++], 0, &value) == ftr_success && value == 5 && next == 1);
+    ftr_delete(futs[0]);
+    ftr_delete(futs[1]);
+
+    fut = ftr_shared_new(i64_future_t);
+    ftr_complete(fut, 3);
+    for (int i = 0; i < 3; i++) {
+        value = 0;
+        assert(ftr_get(fut, 0, &value) == ftr_success && value == 3);
+    }
+    ftr_delete(fut);
+
+    // Anything bigger still goes through ftr_get_.
+    typedef struct { int64_t a, b; } pair_t;
+    typedef ftr_of(pair_t) pair_future_t;
+    pair_future_t* pair = ftr_new(pair_future_t);
+    ftr_complete(pair, ((pair_t){1, 2}));
+    pair_t p = {0};
+    assert(ftr_get(pair, 0, &p) == ftr_success && p.a == 1 && p.b == 2);
+    ftr_delete(pair);
+    return true;
+}
+
+bool ftr_test_cache_align() {
+    printf("ftr_test_cache_align\n");
+
+    int_future_t* fut = ftr_new(int_future_t);
+    struct ftr_pool* pool = ftr_pool_create(int_future_t, 4);
+    int_future_t* pooled = ftr_pool_acquire(pool);
+#ifdef ftr_cache_align
+    // Header and value each on their own line, wherever the future comes from.
+    assert(offsetof(int_future_t, value) % ftr_cacheline == 0);
+    assert(offsetof(int_future_t, value) >= sizeof(struct ftr_header));
+    assert((uintptr_t)fut % ftr_cacheline == 0);
+    assert((uintptr_t)pooled % ftr_cacheline == 0);
+#else
+    assert((uintptr_t)pooled % _Alignof(max_align_t) == 0);
+#endif
+    int value = 0;
+    ftr_complete(pooled, 9);
+    assert(ftr_get(pooled, 0, &value) == ftr_success && value == 9);
+
+    // Combinator results are allocated internally, with as many inputs as it takes.
+    for (size_t n = 0; n < 16; n++) {
+        int_future_t* inputs[16];
+        for (size_t i = 0; i < n; i++) {
+            inputs[i] = pooled;
         }
+        ftr_when_future_t* all = ftr_when_all(inputs, n);
+        assert(all && (uintptr_t)all % _Alignof(ftr_when_future_t) == 0);
+        assert(ftr_wait(all, 0) == ftr_success);
+        ftr_delete(all);
+    }
+    ftr_pool_release(pool, pooled);
+    ftr_pool_destroy(pool);
+    ftr_delete(fut);
+    return true;
+}
 
-        thrd_sleep(&(struct timespec){.tv_sec=1}, NULL);
+#ifdef ftr_has_pshared_
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+bool ftr_test_pshared() {
+    printf("ftr_test_pshared\n");
+
+    // The same file mapped twice, as a second process would see it at its own address.
+    FILE* file = tmpfile();
+    assert(file && ftruncate(fileno(file), 4096) == 0);
+    int_future_t* a = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(file), 0);
+    int_future_t* b = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(file), 0);
+    assert(a != MAP_FAILED && b != MAP_FAILED && a != b);
+    assert(ftr_pshared_init(int_future_t, a) == ftr_success);
+
+    // A waiter parked through one mapping is woken by a completion through the other.
+    thrd_t waiter;
+    ftr_set_spin(b, 0);
+    thrd_create(&waiter, run_wait, b);
+    thrd_sleep(&(struct timespec){.tv_nsec=50*1000*1000}, NULL);
+    ftr_complete(a, 1);
+    int res = -1;
+    thrd_join(waiter, &res);
+    assert(res == ftr_success);
+
+    int value = 0;
+    assert(ftr_get(b, 0, &value) == ftr_success && value == 1);
+    assert(ftr_reset(a) == ftr_success);
+
+    // Another process completes it.
+    pid_t child = fork();
+    assert(child >= 0);
+    if (child == 0) {
+        thrd_sleep(&(struct timespec){.tv_nsec=50*1000*1000}, NULL);
+        _exit(ftr_complete(b, 42) == ftr_success ? 0 : 1);
     }
+    assert(ftr_get(a, 4 * 1000, &value) == ftr_success && value == 42);
+    int status = 0;
+    assert(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
 
-    err = ftr_get(fut, 4 * 1000, &result);
-    assert(err == ftr_success);
-    assert(result == 42);
+    // Nothing can be run on completion in another process.
+    struct then_log log = {0};
+    assert(ftr_reset(a) == ftr_success);
+    assert(ftr_then(a, log_then, &log) == ftr_invalid);
+    struct ftr_header* futs[] = { &a->header };
+    assert(ftr_when_(futs, 1, false) == NULL);
 
-    thrd_join(thread, NULL);
+    ftr_destroy(a);
+    munmap(a, 4096);
+    munmap(b, 4096);
+    fclose(file);
+    return true;
+}
+
+#endif
+
+bool ftr_test_timeout() {
+    printf("ftr_test_timeout\n");
+
+    // Fails a future nobody completes, waking its waiters.
+    int_future_t* fut = ftr_new(int_future_t);
+    struct timespec start;
+    ftr_now(&start);
+    assert(ftr_timeout(fut, 20) == ftr_success);
+    assert(ftr_wait(fut, 4 * 1000) == ftr_timedout);
+    int64_t us = elapsed_us(&start);
+    assert(us >= 20 * 1000 && us < 2 * 1000 * 1000);
+    assert(ftr_complete(fut, 1) != ftr_success);
+    ftr_delete(fut);
+
+    // Completing first disarms it.
+    fut = ftr_new(int_future_t);
+    assert(ftr_timeout(fut, 20) == ftr_success);
+    ftr_complete(fut, 2);
+    thrd_sleep(&(struct timespec){.tv_nsec=50*1000*1000}, NULL);
+    int value = 0;
+    assert(ftr_get(fut, 0, &value) == ftr_success && value == 2);
+
+    // Nothing to do for a future that is already done.
+    assert(ftr_timeout(fut, 0) == ftr_success);
+    assert(ftr_timeout(fut, -1) == ftr_invalid);
+    ftr_delete(fut);
+
+    // Past the lowest level, timers are refiled on time rather than a turn late.
+    fut = ftr_new(int_future_t);
+    ftr_now(&start);
+    assert(ftr_timeout(fut, 300) == ftr_success);
+    assert(ftr_wait(fut, 4 * 1000) == ftr_timedout);
+    us = elapsed_us(&start);
+    assert(us >= 300 * 1000 && us < 1000 * 1000);
     ftr_delete(fut);
+
+    // Far-off timers sit in the higher levels until disarmed, the future outlives ftr_delete meanwhile.
+    fut = ftr_new(int_future_t);
+    assert(ftr_timeout(fut, 60 * 1000) == ftr_success);
+    assert(ftr_timeout(fut, INT32_MAX) == ftr_success);
+    ftr_cancel(fut);
+    ftr_delete(fut);
+
+    // Many at once, expiring over a few turns of the lowest level, half completed well before.
+    // (ftr_new'd ones, which the wheel thread holds a reference on while it fails them.)
+    const size_t n = 10 * 1000;
+    int_future_t** futs = calloc(n, sizeof(int_future_t*));
+    for (size_t i = 0; i < n; i++) {
+        futs[i] = ftr_new(int_future_t);
+        assert(ftr_timeout(futs[i], (int32_t)(100 + i % 600)) == ftr_success);
+    }
+    for (size_t i = 0; i < n; i += 2) {
+        ftr_complete(futs[i], (int)i);
+    }
+    for (size_t i = 0; i < n; i++) {
+        int err = ftr_get(futs[i], 4 * 1000, &value);
+        assert((i % 2) ? err == ftr_timedout : (err == ftr_success && value == (int)i));
+        ftr_delete(futs[i]);
+    }
+    free(futs);
     return true;
 }
 
-struct data {
-    char name[64];
-    int x;
-    int y;
+struct cache_log {
+    atomic_int calls;
+    void* last;
 };
 
-typedef ftr_of(struct data) data_future_t;
+void cache_start(void* arg, const char* key, void* future) {
+    (void)key;
+    struct cache_log* log = arg;
+    atomic_fetch_add(&log->calls, 1);
+    log->last = future;
+}
 
-int run_async_task_struct(void* arg) {
-    data_future_t* fut = arg;
-    thrd_sleep(&(struct timespec){.tv_sec=2}, NULL);
+void cache_start_ready(void* arg, const char* key, void* future) {
+    cache_start(arg, key, future);
+    ftr_complete((int_future_t*)future, (int)strlen(key));
+}
 
-    struct data mydata = { "foobar", 200, 400 };
-    int err = ftr_complete(fut, mydata);
-    if (err) {
-        fprintf(stderr, "error completing future: %s\n", ftr_errorstr(err));
-        return 1;
-    }
+struct cache_caller {
+    struct ftr_cache* cache;
+    struct cache_log* log;
+    ftr_when_future_t* start;
+    int_future_t* fut;
+};
+
+int run_cache_caller(void* arg) {
+    struct cache_caller* c = arg;
+    ftr_wait(c->start, 4 * 1000);
+    c->fut = ftr_cache_get_or_start(c->cache, "shared", cache_start, c->log);
     return 0;
 }
 
-bool ftr_test_struct() {
-    printf("ftr_test_struct\n");
+bool ftr_test_cache() {
+    printf("ftr_test_cache\n");
 
-    data_future_t* fut = ftr_new(data_future_t);
+    struct cache_log log = {0};
+    struct ftr_cache* cache = ftr_cache_create(int_future_t, 4, 64, 50);
 
-    thrd_t thread = {0};
+    // One start per key while it's pending or fresh, every caller gets the same future.
+    int_future_t* a = ftr_cache_get_or_start(cache, "a", cache_start, &log);
+    int_future_t* b = ftr_cache_get_or_start(cache, "a", cache_start, &log);
+    assert(a && a == b && log.calls == 1 && log.last == a);
+    ftr_complete(a, 7);
+    int value = 0;
+    assert(ftr_get(a, 0, &value) == ftr_success && value == 7);
+    assert(ftr_get(b, 0, &value) == ftr_success && value == 7); // Shared
+    ftr_delete(b);
+    b = ftr_cache_get_or_start(cache, "a", cache_start, &log);
+    assert(b == a && log.calls == 1);
+    ftr_delete(b);
 
-    thrd_create(&thread, run_async_task_struct, fut);
-   
-    struct data result;
-    int err = ftr_get(fut, 4 * 1000, &result);
-    assert(err == ftr_success);
-    if (err) {
-        fprintf(stderr, "error waiting future: %s\n", ftr_errorstr(err));
-        thrd_join(thread, NULL);
-        ftr_delete(fut);
-        return false;
+    int_future_t* other = ftr_cache_get_or_start(cache, "b", cache_start_ready, &log);
+    assert(other != a && log.calls == 2);
+    assert(ftr_get(other, 0, &value) == ftr_success && value == 1);
+    ftr_delete(other);
+
+    // Stale after the ttl.
+    thrd_sleep(&(struct timespec){.tv_nsec=100*1000*1000}, NULL);
+    b = ftr_cache_get_or_start(cache, "a", cache_start_ready, &log);
+    assert(b != a && log.calls == 3);
+    ftr_delete(b);
+    ftr_delete(a);
+
+    // Failures aren't kept, and entries can be dropped explicitly.
+    a = ftr_cache_get_or_start(cache, "c", cache_start, &log);
+    ftr_fail(a, ftr_test_error);
+    b = ftr_cache_get_or_start(cache, "c", cache_start, &log);
+    assert(b != a && log.calls == 5);
+    ftr_delete(a);
+    ftr_cache_remove(cache, "c");
+    a = ftr_cache_get_or_start(cache, "c", cache_start, &log);
+    assert(a != b && log.calls == 6);
+    ftr_cancel(b); // Never completed otherwise, the cache's continuation would keep it alive
+    ftr_delete(b);
+
+    // Outlives the cache.
+    ftr_cache_destroy(cache);
+    ftr_complete(a, 3);
+    assert(ftr_get(a, 0, &value) == ftr_success && value == 3);
+    ftr_delete(a);
+
+    // A full shard evicts its least recently used completed entry, never a pending one.
+    atomic_store(&log.calls, 0);
+    cache = ftr_cache_create(int_future_t, 1, 2, 60 * 1000);
+    int_future_t* pending = ftr_cache_get_or_start(cache, "pending", cache_start, &log);
+    ftr_delete(ftr_cache_get_or_start(cache, "x", cache_start_ready, &log));
+    ftr_delete(ftr_cache_get_or_start(cache, "y", cache_start_ready, &log));
+    ftr_delete(ftr_cache_get_or_start(cache, "y", cache_start_ready, &log));
+    assert(log.calls == 3);
+    ftr_delete(ftr_cache_get_or_start(cache, "x", cache_start_ready, &log));
+    assert(log.calls == 4);
+    b = ftr_cache_get_or_start(cache, "pending", cache_start, &log);
+    assert(b == pending && log.calls == 4);
+    ftr_delete(b);
+    ftr_cancel(pending);
+    ftr_delete(pending);
+    ftr_cache_destroy(cache);
+
+    // Concurrent callers for the same key share one start.
+    enum { ncallers = 8 };
+    atomic_store(&log.calls, 0);
+    cache = ftr_cache_create(int_future_t, 16, 1024, 60 * 1000);
+    struct cache_caller callers[ncallers];
+    thrd_t threads[ncallers];
+    ftr_when_future_t* start = ftr_shared_new(ftr_when_future_t);
+    for (int i = 0; i < ncallers; i++) {
+        callers[i] = (struct cache_caller){ cache, &log, start, NULL };
+        thrd_create(&threads[i], run_cache_caller, &callers[i]);
     }
- 
-    assert(!strcmp(result.name, "foobar"));
-    assert(result.x == 200);
-    assert(result.y == 400);
+    ftr_complete(start, 0);
+    for (int i = 0; i < ncallers; i++) {
+        thrd_join(threads[i], NULL);
+        assert(callers[i].fut == callers[0].fut);
+    }
+    assert(log.calls == 1);
+    ftr_complete(callers[0].fut, 11);
+    for (int i = 0; i < ncallers; i++) {
+        assert(ftr_get(callers[i].fut, 0, &value) == ftr_success && value == 11);
+        ftr_delete(callers[i].fut);
+    }
+    ftr_delete(start);
+    ftr_cache_destroy(cache);
+    return true;
+}
 
-    thrd_join(thread, NULL);
+struct deferred_log {
+    atomic_int runs;
+    thrd_t thread;
+};
+
+void deferred_task(void* arg, void* value) {
+    struct deferred_log* log = arg;
+    log->thread = thrd_current();
+    *(int*)value = atomic_fetch_add(&log->runs, 1) + 100;
+}
+
+bool ftr_test_deferred() {
+    printf("ftr_test_deferred\n");
+
+    // Runs on the first reader's thread, once.
+    struct deferred_log log = {0};
+    int_future_t* fut = ftr_deferred(int_future_t, deferred_task, &log);
+    assert(fut && atomic_load(&log.runs) == 0);
+    int value = 0;
+    assert(ftr_get(fut, 0, &value) == ftr_success && value == 100);
+    assert(atomic_load(&log.runs) == 1 && thrd_equal(log.thread, thrd_current()));
+    assert(ftr_wait(fut, 0) == ftr_success && atomic_load(&log.runs) == 1);
+    ftr_delete(fut);
+
+    // Never read, never run.
+    fut = ftr_deferred(int_future_t, deferred_task, &log);
+    ftr_delete(fut);
+    fut = ftr_deferred(int_future_t, deferred_task, &log);
+    ftr_cancel(fut);
+    assert(ftr_wait(fut, 0) == ftr_cancelled);
+    ftr_delete(fut);
+    assert(atomic_load(&log.runs) == 1);
+
+    // The combinators count as reading; ftr_wait_any only needs one of them.
+    int_future_t* futs[3];
+    for (int i = 0; i < 3; i++) {
+        futs[i] = ftr_deferred(int_future_t, deferred_task, &log);
+    }
+    size_t index = 9;
+    assert(ftr_wait_any(futs, 3, 0, &index) == ftr_success && index == 0);
+    assert(atomic_load(&log.runs) == 2);
+    assert(ftr_wait_all(futs, 3, 0) == ftr_success && atomic_load(&log.runs) == 4);
+    const int* peeked = NULL;
+    assert(ftr_peek(futs[2], 0, &peeked) == ftr_success && *peeked == 103);
+    for (int i = 0; i < 3; i++) {
+        ftr_delete(futs[i]);
+    }
+
+    // An idle executor runs them ahead of the reader.
+    struct ftr_executor* exec = ftr_executor_create(1);
+    fut = ftr_deferred_on(exec, int_future_t, deferred_task, &log);
+    struct timespec start;
+    ftr_now(&start);
+    while ((atomic_load(&fut->header.state) & ftr_state_mask) < ftr_ready && elapsed_us(&start) < 4 * 1000 * 1000) {
+        thrd_yield();
+    }
+    assert(atomic_load(&log.runs) == 5 && !thrd_equal(log.thread, thrd_current()));
+    assert(ftr_get(fut, 0, &value) == ftr_success && value == 104);
+    ftr_delete(fut);
+
+    // Still on demand if the executor goes away first.
+    fut = ftr_deferred_on(exec, int_future_t, deferred_task, &log);
+    ftr_executor_destroy(exec);
+    assert(ftr_get(fut, 0, &value) == ftr_success);
+    assert(atomic_load(&log.runs) == 6);
+    ftr_delete(fut);
+    return true;
+}
+
+void numa_task(void* arg, void* value) {
+    (void)arg;
+    *(int*)value = ftr_numa_node();
+}
+
+struct numa_log {
+    int node;
+    struct ftr_executor* exec;
+    int_future_t* done;
+};
+
+void numa_then(void* userdata, void* future) {
+    (void)future;
+    struct numa_log* log = userdata;
+    log->node = ftr_numa_node();
+    log->exec = ftr_current_worker_ ? ftr_current_worker_->exec : NULL;
+    ftr_complete(log->done, 1);
+}
+
+bool ftr_test_numa() {
+    printf("ftr_test_numa\n");
+
+    int nodes = ftr_numa_nodes();
+    assert(nodes >= 1);
+    assert(ftr_numa_node() >= 0 && ftr_numa_node() < nodes);
+    assert(!ftr_executor_create_on(1, nodes));
+    assert(!ftr_executor_create_on(1, -2));
+
+    // Workers only ever run on their node, one per CPU by default.
+    struct ftr_executor* exec = ftr_executor_create_on(0, 0);
+    assert(exec && exec->node == 0 && exec->nworkers >= 1);
+    int_future_t* futs[8];
+    for (int i = 0; i < 8; i++) {
+        futs[i] = ftr_async(exec, int_future_t, numa_task, NULL);
+    }
+    for (int i = 0; i < 8; i++) {
+        int node = -1;
+        assert(ftr_get(futs[i], 4 * 1000, &node) == ftr_success && node == 0);
+        ftr_delete(futs[i]);
+    }
+    ftr_executor_destroy(exec);
+
+    // Node-local pools behave like any other.
+    struct ftr_pool* pool = ftr_pool_create_on(int_future_t, 4, 0);
+    assert(pool && pool->node == 0);
+    for (int i = 0; i < 8; i++) {
+        futs[i] = ftr_pool_acquire(pool);
+        assert(futs[i]);
+        ftr_complete(futs[i], i);
+    }
+    for (int i = 0; i < 8; i++) {
+        int value = -1;
+        assert(ftr_get(futs[i], 0, &value) == ftr_success && value == i);
+        ftr_pool_release(pool, futs[i]);
+    }
+    ftr_pool_destroy(pool);
+
+    // Continuations run on the consumer's node.
+    struct ftr_executor** execs = calloc((size_t)nodes, sizeof(struct ftr_executor*));
+    for (int i = 0; i < nodes; i++) {
+        execs[i] = ftr_executor_create_on(1, i);
+    }
+    struct numa_log log = { -1, NULL, ftr_new(int_future_t) };
+    int_future_t* fut = ftr_new(int_future_t);
+    assert(ftr_then_local(execs, fut, numa_then, &log) == ftr_success);
+    ftr_complete(fut, 1);
+    int one = 0;
+    assert(ftr_get(log.done, 4 * 1000, &one) == ftr_success);
+    assert(log.exec && log.exec == execs[log.exec->node] && log.node == log.exec->node);
+    ftr_delete(log.done);
     ftr_delete(fut);
+    for (int i = 0; i < nodes; i++) {
+        if (execs[i]) {
+            ftr_executor_destroy(execs[i]);
+        }
+    }
+    free(execs);
+    return true;
+}
+
+bool ftr_test_promise() {
+    printf("ftr_test_promise\n");
+
+    int_promise_t* promise = malloc(sizeof(int_promise_t));
+    int_handle_t future = {0};
+    assert(ftr_promise_new(int_future_t, promise, &future) == ftr_success);
+    assert(future.state->header.refs == 2);
+
+    // The producer is detached: the state is freed by whichever side is done last.
+    thrd_t thread = {0};
+    thrd_create(&thread, run_promise_producer, promise);
+    thrd_detach(thread);
+
+    int result = 0;
+    assert(ftr_future_get(&future, 4 * 1000, &result) == ftr_success);
+    assert(result == 42);
+    ftr_future_release(&future);
+    assert(future.state == NULL);
+
+    // A promise released without a value breaks the future.
+    int_promise_t p = {0};
+    assert(ftr_promise_new(int_future_t, &p, &future) == ftr_success);
+    ftr_promise_release(&p);
+    assert(p.state == NULL);
+    assert(ftr_future_get(&future, 0, &result) == ftr_broken);
+    ftr_future_release(&future);
+
+    // Releasing the future first tells the producer nobody is waiting anymore.
+    assert(ftr_promise_new(int_future_t, &p, &future) == ftr_success);
+    ftr_future_release(&future);
+    assert(ftr_promise_is_cancelled(&p));
+    assert(ftr_promise_complete(&p, 1) == ftr_cancelled);
+    assert(p.state == NULL);
+    ftr_promise_release(&p); // Already consumed, does nothing
+    return true;
+}
+
+#ifndef _WIN32
+
+#include <poll.h>
+
+static bool fd_readable(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    return poll(&pfd, 1, 0) == 1;
+}
+
+bool ftr_test_notifier() {
+    printf("ftr_test_notifier\n");
+
+    struct ftr_notifier* n = ftr_notifier_create();
+    assert(n);
+    int fd = ftr_get_fd(n);
+    assert(!fd_readable(fd));
+
+    enum { nfuts = 4 };
+    int_future_t* futs[nfuts];
+    for (int i = 0; i < nfuts; i++) {
+        futs[i] = ftr_new(int_future_t);
+        assert(ftr_notify(n, futs[i]) == ftr_success); // The notifier now owns our reference
+    }
+
+    struct delayed_completion dcs[2] = { { futs[0], 10, 0 }, { futs[2], 12, 0 } };
+    thrd_t threads[2];
+    for (int i = 0; i < 2; i++) {
+        thrd_create(&threads[i], run_delayed_completion, &dcs[i]);
+        thrd_join(threads[i], NULL);
+    }
+
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    assert(poll(&pfd, 1, 4 * 1000) == 1);
+
+    // Both completions are drained with a single wakeup, one at a time here.
+    int_future_t* ready[nfuts];
+    assert(ftr_notifier_drain(n, ready, 1) == 1);
+    assert(fd_readable(fd) || !"still readable while there's a backlog");
+    assert(ftr_notifier_drain(n, ready + 1, nfuts) == 1);
+    assert(!fd_readable(fd));
+    int sum = 0;
+    for (int i = 0; i < 2; i++) {
+        int result = 0;
+        assert(ftr_get(ready[i], 0, &result) == ftr_success);
+        sum += result;
+        ftr_delete(ready[i]);
+    }
+    assert(sum == 22);
+
+    ftr_complete(futs[1], 11);
+    assert(fd_readable(fd));
+    assert(ftr_notifier_drain(n, ready, nfuts) == 1 && ready[0] == futs[1]);
+    ftr_delete(ready[0]);
+
+    // Completions queued while a backlog is pending, after the drain's reset signalled
+    // nothing new, are drained along with it, or keep the descriptor readable.
+    int_future_t* more[6];
+    for (int i = 0; i < 6; i++) {
+        more[i] = ftr_new(int_future_t);
+        assert(ftr_notify(n, more[i]) == ftr_success);
+    }
+    for (int round = 0; round < 2; round++) {
+        int_future_t** m = more + round * 3;
+        ftr_complete(m[0], 0);
+        ftr_complete(m[1], 1);
+        assert(ftr_notifier_drain(n, ready, 1) == 1 && ready[0] == m[0]);
+        ftr_complete(m[2], 2);
+        if (round == 0) {
+            assert(ftr_notifier_drain(n, ready + 1, nfuts) == 2);
+            assert(ready[1] == m[1] && ready[2] == m[2]);
+        } else {
+            assert(ftr_notifier_drain(n, ready + 1, 1) == 1 && ready[1] == m[1]);
+            assert(fd_readable(fd) || !"readable while a completion is queued");
+            assert(ftr_notifier_drain(n, ready + 2, nfuts) == 1 && ready[2] == m[2]);
+        }
+        assert(!fd_readable(fd));
+        for (int i = 0; i < 3; i++) {
+            ftr_delete(ready[i]);
+        }
+    }
+
+    // Undrained and still pending futures are released by the notifier.
+    ftr_notifier_destroy(n);
+    ftr_complete(futs[3], 13);
+
+    // A completion that saw the notifier open, stalled, and pushed after destroy drained
+    // it: its node is released with the last reference.
+    n = ftr_notifier_create();
+    int_future_t* late = ftr_new(int_future_t);
+    ftr_ref_(&late->header);
+    atomic_fetch_add(&n->refs, 1); // Held by the stalled completion, like ftr_notify_ does
+    ftr_notifier_destroy(n);
+    struct ftr_notify_node_* nn = calloc(1, sizeof(struct ftr_notify_node_));
+    nn->notifier = n;
+    nn->future = &late->header;
+    atomic_store(&n->ready, nn);
+    ftr_notifier_unref_(n);
+    assert(atomic_load(&late->header.refs) == 1);
+    ftr_delete(late);
     return true;
 }
 
+#endif
+
 bool ftr_runtest() {
     return (
         ftr_test_valuesize() &&
         ftr_test_twice() &&
         ftr_test_samethread() &&
+        ftr_test_states() &&
         ftr_test_success() &&
         ftr_test_timedout() &&
         ftr_test_tryagain() &&
         ftr_test_wait() &&
-        ftr_test_struct()
+        ftr_test_struct() &&
+        ftr_test_inplace() &&
+        ftr_test_peek() &&
+        ftr_test_shared() &&
+        ftr_test_pool() &&
+        ftr_test_array() &&
+        ftr_test_executor() &&
+        ftr_test_then() &&
+        ftr_test_when() &&
+        ftr_test_spin() &&
+        ftr_test_deadline() &&
+        ftr_test_cancel() &&
+        ftr_test_fail() &&
+        ftr_test_batch() &&
+        ftr_test_channel() &&
+        ftr_test_reset() &&
+        ftr_test_stats() &&
+        ftr_test_trace() &&
+        ftr_test_small() &&
+        ftr_test_cache_align() &&
+        ftr_test_timeout() &&
+        ftr_test_cache() &&
+        ftr_test_deferred() &&
+        ftr_test_numa() &&
+#ifdef ftr_has_pshared_
+        ftr_test_pshared() &&
+#endif
+        ftr_test_promise() &&
+#ifndef _WIN32
+        ftr_test_notifier() &&
+#endif
+        true
     );
 }
 
@@ -0,0 +1,236 @@
+/**
+ * future.hpp - C++20 coroutine adapter for future.c.
+ * Public Domain.
+ *
+ * Usage:
+ *
+ * typedef ftr_of(int) int_ftr_t;
+ *
+ * task handle_request(int_ftr_t* fut, struct ftr_executor* exec) {
+ *   ftr_result<int> r = co_await ftr_awaitable(fut, exec);
+ *   if (r.err) {
+ *     fprintf(stderr, "request failed: %s", ftr_errorstr(r.err));
+ *     co_return;
+ *   }
+ *   reply(r.value);
+ * }
+ *
+ * future.c itself must still be compiled as C (with ftr_implementation) in some
+ * translation unit; this header only needs its declarations.
+ */
+
+#pragma once
+
+#include <coroutine>
+#include <type_traits>
+#include <utility>
+
+#include "future.c"
+
+template <class T>
+struct ftr_result {
+    int err; // ftr_success, or why there's no value (ftr_cancelled, a code passed to ftr_fail, ...)
+    T value;
+};
+
+inline void ftr_resume_(void* userdata, void* future) {
+    (void)future;
+    std::coroutine_handle<>::from_address(userdata).resume();
+}
+
+/**
+ * Suspending registers the coroutine as a continuation of the future, embedded in the
+ * awaiter (which lives in the coroutine frame), so no thread blocks and nothing is
+ * allocated. Without an executor the coroutine is resumed inline by the thread that
+ * completes the future; with one it's always resumed on one of its workers.
+ * The future is consumed like with ftr_get, and must outlive the co_await.
+ */
+template <class FT>
+struct ftr_awaiter {
+    using value_type = std::remove_cvref_t<decltype(std::declval<FT&>().value)>;
+
+    FT* future;
+    struct ftr_executor* exec;
+    struct ftr_continuation node;
+    int err; // Set when the continuation was rejected (pshared futures), then not suspended
+
+    bool await_ready() const noexcept {
+        return !exec && ftr_wait(future, 0) != ftr_timedout;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) noexcept {
+        node = {};
+        node.fn = ftr_resume_;
+        node.userdata = handle.address();
+        node.exec = exec;
+        // On success the coroutine may be resumed (and this awaiter gone) before this returns.
+        int e = ftr_then_node(future, &node);
+        if (e) {
+            err = e;
+            return false;
+        }
+        return true;
+    }
+
+    ftr_result<value_type> await_resume() {
+        ftr_result<value_type> result{};
+        result.err = err ? err : ftr_get(future, 0, &result.value);
+        return result;
+    }
+};
+
+template <class FT>
+ftr_awaiter<FT> ftr_awaitable(FT* future, struct ftr_executor* exec = nullptr) {
+    return ftr_awaiter<FT>{future, exec, {}, ftr_success};
+}
+
+#ifdef ftr_hpp_unittest
+
+#include <cassert>
+#include <exception>
+
+typedef ftr_of(int) int_future_t;
+
+// Fire-and-forget coroutine, enough to drive the tests.
+struct ftr_test_task {
+    struct promise_type {
+        ftr_test_task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+struct await_log {
+    int err;
+    int value;
+    thrd_t thread;
+};
+
+// Completes `done` once resumed, so the test can wait for the coroutine.
+ftr_test_task await_into(int_future_t* fut, struct ftr_executor* exec, struct await_log* log, int_future_t* done) {
+    ftr_result<int> r = co_await ftr_awaitable(fut, exec);
+    log->err = r.err;
+    log->value = r.value;
+    log->thread = thrd_current();
+    ftr_complete(done, 1);
+}
+
+bool ftr_hpp_test_inline() {
+    printf("ftr_hpp_test_inline\n");
+
+    int_future_t* fut = ftr_new(int_future_t);
+    int_future_t* done = ftr_new(int_future_t);
+    struct await_log log = {};
+    await_into(fut, nullptr, &log, done);
+    assert(ftr_wait(done, 0) == ftr_timedout);
+
+    // Resumed by the completing thread, before ftr_complete returns.
+    ftr_complete(fut, 42);
+    assert(ftr_wait(done, 0) == ftr_success);
+    assert(log.err == ftr_success && log.value == 42);
+    ftr_delete(done);
+    ftr_delete(fut);
+
+    // Already complete: doesn't suspend at all.
+    fut = ftr_new(int_future_t);
+    done = ftr_new(int_future_t);
+    ftr_complete(fut, 7);
+    await_into(fut, nullptr, &log, done);
+    assert(ftr_wait(done, 0) == ftr_success);
+    assert(log.err == ftr_success && log.value == 7);
+    ftr_delete(done);
+    ftr_delete(fut);
+
+    // Failures and cancellation are reported instead of a value.
+    fut = ftr_new(int_future_t);
+    done = ftr_new(int_future_t);
+    await_into(fut, nullptr, &log, done);
+    ftr_fail(fut, ftr_cancelled + 100);
+    assert(ftr_wait(done, 0) == ftr_success);
+    assert(log.err == ftr_cancelled + 100);
+    ftr_delete(done);
+    ftr_delete(fut);
+
+    fut = ftr_new(int_future_t);
+    done = ftr_new(int_future_t);
+    await_into(fut, nullptr, &log, done);
+    ftr_cancel(fut);
+    assert(ftr_wait(done, 0) == ftr_success);
+    assert(log.err == ftr_cancelled);
+    ftr_delete(done);
+    ftr_delete(fut);
+    return true;
+}
+
+bool ftr_hpp_test_executor() {
+    printf("ftr_hpp_test_executor\n");
+
+    struct ftr_executor* exec = ftr_executor_create(1);
+
+    int_future_t* fut = ftr_new(int_future_t);
+    int_future_t* done = ftr_new(int_future_t);
+    struct await_log log = {};
+    await_into(fut, exec, &log, done);
+    ftr_complete(fut, 5);
+    int one = 0;
+    assert(ftr_get(done, 1000, &one) == ftr_success);
+    assert(log.err == ftr_success && log.value == 5);
+    assert(!thrd_equal(log.thread, thrd_current()));
+    ftr_delete(done);
+    ftr_delete(fut);
+
+    // Even when the future is already complete.
+    fut = ftr_new(int_future_t);
+    done = ftr_new(int_future_t);
+    ftr_complete(fut, 6);
+    await_into(fut, exec, &log, done);
+    assert(ftr_get(done, 1000, &one) == ftr_success);
+    assert(log.err == ftr_success && log.value == 6);
+    assert(!thrd_equal(log.thread, thrd_current()));
+    ftr_delete(done);
+    ftr_delete(fut);
+
+    ftr_executor_destroy(exec);
+    return true;
+}
+
+#ifdef ftr_has_pshared_
+bool ftr_hpp_test_pshared() {
+    printf("ftr_hpp_test_pshared\n");
+
+    // Continuations are rejected, so the coroutine isn't suspended and reports why.
+    int_future_t* fut = static_cast<int_future_t*>(calloc(1, sizeof(int_future_t)));
+    assert(ftr_pshared_init(int_future_t, fut) == ftr_success);
+    int_future_t* done = ftr_new(int_future_t);
+    struct await_log log = {};
+    await_into(fut, nullptr, &log, done);
+    assert(ftr_wait(done, 0) == ftr_success);
+    assert(log.err == ftr_invalid);
+    assert(ftr_wait(fut, 0) == ftr_timedout);
+    ftr_delete(done);
+
+    // Already complete: read directly like any future.
+    ftr_complete(fut, 3);
+    done = ftr_new(int_future_t);
+    await_into(fut, nullptr, &log, done);
+    assert(ftr_wait(done, 0) == ftr_success);
+    assert(log.err == ftr_success && log.value == 3);
+    ftr_delete(done);
+    ftr_destroy(fut);
+    free(fut);
+    return true;
+}
+#endif
+
+bool ftr_hpp_runtest() {
+    return ftr_hpp_test_inline() &&
+        ftr_hpp_test_executor() &&
+#ifdef ftr_has_pshared_
+        ftr_hpp_test_pshared() &&
+#endif
+        true;
+}
+
+#endif
@@ -0,0 +1,294 @@
+/**
+ * future_bench - Microbenchmarks for future.c.
+ *
+ * Usage: future_bench [max_threads]
+ *
+ * Prints one JSON object per line, so results can be diffed or collected between
+ * releases. Times are in nanoseconds. max_threads defaults to the number of online CPUs.
+ */
+
+#define ftr_implementation
+
+#include "future.c"
+
+typedef ftr_of(int) int_future_t;
+typedef ftr_of(int64_t) stamp_future_t;
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    ftr_now(&ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_i64(const void* a, const void* b) {
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static int64_t percentile(const int64_t* sorted, size_t n, double p) {
+    size_t i = (size_t)(p * (double)(n - 1));
+    return sorted[i];
+}
+
+static void report_rate(const char* bench, int threads, size_t ops, int64_t elapsed_ns) {
+    printf("{\"bench\":\"%s\",\"threads\":%d,\"ops\":%zu,\"ns_per_op\":%.1f,\"ops_per_sec\":%.0f}\n",
+           bench, threads, ops, (double)elapsed_ns / (double)ops, (double)ops * 1e9 / (double)elapsed_ns);
+}
+
+static void report_percentiles(const char* bench, int waiters, int64_t* samples, size_t n) {
+    qsort(samples, n, sizeof(samples[0]), cmp_i64);
+    printf("{\"bench\":\"%s\",\"waiters\":%d,\"samples\":%zu,\"p50_ns\":%lld,\"p99_ns\":%lld,\"p999_ns\":%lld,\"max_ns\":%lld}\n",
+           bench, waiters, n, (long long)percentile(samples, n, 0.5), (long long)percentile(samples, n, 0.99),
+           (long long)percentile(samples, n, 0.999), (long long)samples[n - 1]);
+}
+
+static void bench_new_delete(size_t n) {
+    int64_t start = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        int_future_t* fut = ftr_new(int_future_t);
+        ftr_delete(fut);
+    }
+    report_rate("new_delete", 1, n, now_ns() - start);
+
+    struct ftr_pool* pool = ftr_pool_create(int_future_t, 64);
+    start = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        int_future_t* fut = ftr_pool_acquire(pool);
+        ftr_pool_release(pool, fut);
+    }
+    report_rate("pool_acquire_release", 1, n, now_ns() - start);
+    ftr_pool_destroy(pool);
+}
+
+static void bench_complete_get(size_t n) {
+    int_future_t* fut = ftr_new(int_future_t);
+    int value = 0;
+    int64_t start = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        ftr_complete(fut, (int)i);
+        ftr_get(fut, 0, &value);
+        ftr_reset(fut);
+    }
+    report_rate("complete_get", 1, n, now_ns() - start);
+    ftr_delete(fut);
+
+    start = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        fut = ftr_new(int_future_t);
+        ftr_complete(fut, (int)i);
+        ftr_get(fut, 0, &value);
+        ftr_delete(fut);
+    }
+    report_rate("new_complete_get_delete", 1, n, now_ns() - start);
+}
+
+struct handoff {
+    stamp_future_t* requests;
+    int_future_t* acks;
+    int64_t* samples;
+    size_t n;
+};
+
+static int run_handoff_consumer(void* arg) {
+    struct handoff* h = arg;
+    for (size_t i = 0; i < h->n; i++) {
+        stamp_future_t* req = ftr_array_at(h->requests, i);
+        int64_t stamp = 0;
+        ftr_get(req, 10 * 1000, &stamp);
+        h->samples[i] = now_ns() - stamp;
+        ftr_complete((int_future_t*)ftr_array_at(h->acks, i), 1);
+    }
+    return 0;
+}
+
+// One-way latency from ftr_complete on one thread to ftr_get returning on another.
+static void bench_handoff(size_t n) {
+    struct handoff h = {
+        .requests = ftr_new_array(stamp_future_t, n),
+        .acks = ftr_new_array(int_future_t, n),
+        .samples = calloc(n, sizeof(int64_t)),
+        .n = n,
+    };
+
+    thrd_t consumer;
+    thrd_create(&consumer, run_handoff_consumer, &h);
+    for (size_t i = 0; i < n; i++) {
+        ftr_complete((stamp_future_t*)ftr_array_at(h.requests, i), now_ns());
+        ftr_wait((int_future_t*)ftr_array_at(h.acks, i), 10 * 1000);
+    }
+    thrd_join(consumer, NULL);
+
+    report_percentiles("handoff", 1, h.samples, n);
+    ftr_delete_array(h.requests, n);
+    ftr_delete_array(h.acks, n);
+    free(h.samples);
+}
+
+struct waiter {
+    int_future_t* fut;
+    int64_t woken;
+};
+
+static int run_waiter(void* arg) {
+    struct waiter* w = arg;
+    ftr_wait(w->fut, 10 * 1000);
+    w->woken = now_ns();
+    return 0;
+}
+
+// Time from ftr_complete until the last of `nwaiters` parked threads is running again.
+static void bench_wakeup(int nwaiters, size_t rounds) {
+    int64_t* samples = calloc(rounds, sizeof(int64_t));
+    struct waiter* waiters = calloc((size_t)nwaiters, sizeof(struct waiter));
+    thrd_t* threads = calloc((size_t)nwaiters, sizeof(thrd_t));
+
+    for (size_t r = 0; r < rounds; r++) {
+        int_future_t* fut = ftr_new(int_future_t);
+        ftr_set_spin(fut, 0);
+        for (int i = 0; i < nwaiters; i++) {
+            waiters[i] = (struct waiter){ fut, 0 };
+            thrd_create(&threads[i], run_waiter, &waiters[i]);
+        }
+        thrd_sleep(&(struct timespec){.tv_nsec=20*1000*1000}, NULL); // Let them park
+
+        int64_t start = now_ns();
+        ftr_complete(fut, 1);
+        int64_t last = start;
+        for (int i = 0; i < nwaiters; i++) {
+            thrd_join(threads[i], NULL);
+            last = waiters[i].woken > last ? waiters[i].woken : last;
+        }
+        samples[r] = last - start;
+        ftr_delete(fut);
+    }
+
+    report_percentiles("wakeup", nwaiters, samples, rounds);
+    free(samples);
+    free(waiters);
+    free(threads);
+}
+
+struct scaling {
+    size_t n;
+    ftr_when_future_t* start;
+};
+
+static int run_scaling(void* arg) {
+    struct scaling* s = arg;
+    ftr_wait(s->start, 10 * 1000);
+    int value = 0;
+    for (size_t i = 0; i < s->n; i++) {
+        int_future_t* fut = ftr_new(int_future_t);
+        ftr_complete(fut, (int)i);
+        ftr_get(fut, 0, &value);
+        ftr_delete(fut);
+    }
+    return value;
+}
+
+// Independent new/complete/get/delete loops on every thread, to expose shared state.
+static void bench_scaling(int max_threads, size_t n) {
+    thrd_t* threads = calloc((size_t)max_threads, sizeof(thrd_t));
+    for (int nthreads = 1; nthreads <= max_threads;) {
+        struct scaling s = { n, ftr_shared_new(ftr_when_future_t) };
+        for (int i = 0; i < nthreads; i++) {
+            thrd_create(&threads[i], run_scaling, &s);
+        }
+        int64_t start = now_ns();
+        ftr_complete(s.start, 0);
+        for (int i = 0; i < nthreads; i++) {
+            thrd_join(threads[i], NULL);
+        }
+        report_rate("scaling", nthreads, n * (size_t)nthreads, now_ns() - start);
+        ftr_delete(s.start);
+
+        // Powers of two, always ending with max_threads.
+        if (nthreads == max_threads) {
+            break;
+        }
+        nthreads = nthreads * 2 < max_threads ? nthreads * 2 : max_threads;
+    }
+    free(threads);
+}
+
+struct neighbor {
+    int_future_t* fut;
+    size_t n;
+    ftr_when_future_t* start;
+};
+
+static int run_neighbor(void* arg) {
+    struct neighbor* nb = arg;
+    ftr_wait(nb->start, 10 * 1000);
+    int value = 0;
+    for (size_t i = 0; i < nb->n; i++) {
+        ftr_complete(nb->fut, (int)i);
+        ftr_get(nb->fut, 0, &value);
+        ftr_reset(nb->fut);
+    }
+    return value;
+}
+
+// Every thread reuses its own future, allocated back to back with the others' like
+// unrelated futures usually are. Only the layout (see future_bench_aligned) decides
+// whether they share cache lines.
+static void bench_neighbors(int max_threads, size_t n) {
+    thrd_t* threads = calloc((size_t)max_threads, sizeof(thrd_t));
+    struct neighbor* nbs = calloc((size_t)max_threads, sizeof(struct neighbor));
+    for (int nthreads = 1; nthreads <= max_threads;) {
+        ftr_when_future_t* start = ftr_shared_new(ftr_when_future_t);
+        for (int i = 0; i < nthreads; i++) {
+            nbs[i] = (struct neighbor){ ftr_new(int_future_t), n, start };
+        }
+        for (int i = 0; i < nthreads; i++) {
+            thrd_create(&threads[i], run_neighbor, &nbs[i]);
+        }
+        int64_t begin = now_ns();
+        ftr_complete(start, 0);
+        for (int i = 0; i < nthreads; i++) {
+            thrd_join(threads[i], NULL);
+        }
+        report_rate("neighbors", nthreads, n * (size_t)nthreads, now_ns() - begin);
+        for (int i = 0; i < nthreads; i++) {
+            ftr_delete(nbs[i].fut);
+        }
+        ftr_delete(start);
+
+        if (nthreads == max_threads) {
+            break;
+        }
+        nthreads = nthreads * 2 < max_threads ? nthreads * 2 : max_threads;
+    }
+    free(nbs);
+    free(threads);
+}
+
+static int online_cpus(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+int main(int argc, const char** argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : online_cpus();
+    if (max_threads < 1) {
+        fprintf(stderr, "usage: %s [max_threads]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    bench_new_delete(1000 * 1000);
+    bench_complete_get(1000 * 1000);
+    bench_handoff(20 * 1000);
+    for (int nwaiters = 1; nwaiters <= 64; nwaiters *= 4) {
+        bench_wakeup(nwaiters, 20);
+    }
+    bench_scaling(max_threads, 200 * 1000);
+    bench_neighbors(max_threads, 200 * 1000);
+    return EXIT_SUCCESS;
+}
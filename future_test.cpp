@@ -0,0 +1,13 @@
+#define ftr_hpp_unittest
+
+#include "future.hpp"
+
+int main(int argc, const char** argv) {
+    (void)argc;
+    (void)argv;
+
+    if (ftr_hpp_runtest()) {
+        return EXIT_SUCCESS;
+    }
+    return EXIT_FAILURE;
+}
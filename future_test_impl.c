@@ -0,0 +1,4 @@
+// The C implementation linked into the C++ tests.
+#define ftr_implementation
+
+#include "future.c"